@@ -0,0 +1,39 @@
+import sys
+import json
+
+"""
+    Compare two outputs of bench/micro:
+    python3 bench/compare.py before.jsonl after.jsonl
+"""
+
+
+def load(filename):
+    result = {}
+    with open(filename) as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            row = json.loads(line)
+            result[row['bench']] = row['ns_per_op']
+    return result
+
+
+def main():
+    if len(sys.argv) != 3:
+        print('usage: compare.py before.jsonl after.jsonl')
+        return 1
+    before = load(sys.argv[1])
+    after = load(sys.argv[2])
+    for name, value in after.items():
+        if name not in before:
+            print(f'{name:40} {value:12.2f} ns  (new)')
+            continue
+        prev = before[name]
+        change = (value - prev) / prev * 100 if prev else 0
+        print(f'{name:40} {prev:12.2f} -> {value:12.2f} ns  {change:+7.1f}%')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+
+/*
+    Minimal http client parts for load tools.
+*/
+
+
+typedef uint64_t u64;
+
+static inline u64 now_us() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (u64)spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+
+struct Response {
+    int code = 0;
+    std::string id;
+    std::string name;
+    size_t body_start = 0;
+    size_t body_size = 0;
+};
+
+
+static inline std::string http_post(const std::string &path, const std::string &body, const std::string &headers="") {
+    std::string r = "POST /" + path + " HTTP/1.1\r\nHost: ijson\r\n" + headers;
+    r += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    r += body;
+    return r;
+}
+
+
+static inline int connect_to(const std::string &host, int port) {
+    // non-blocking socket after connect
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+// returns size of a complete response in buffer, 0 if it is not complete
+static inline size_t parse_response(const std::string &in, Response &r) {
+    size_t end = in.find("\r\n\r\n");
+    if(end == std::string::npos) return 0;
+    r.code = 0;
+    if(in.size() > 12) r.code = atoi(in.c_str() + 9);
+    r.body_size = 0;
+    r.id.clear();
+    r.name.clear();
+    size_t pos = in.find("\r\n");
+    while(pos < end) {
+        size_t next = in.find("\r\n", pos + 2);
+        const char *line = in.c_str() + pos + 2;
+        size_t len = next - pos - 2;
+        if(len > 16 && strncasecmp(line, "Content-Length: ", 16) == 0) r.body_size = atol(line + 16);
+        else if(len > 4 && strncasecmp(line, "Id: ", 4) == 0) r.id.assign(line + 4, len - 4);
+        else if(len > 6 && strncasecmp(line, "Name: ", 6) == 0) r.name.assign(line + 6, len - 6);
+        pos = next;
+    }
+    r.body_start = end + 4;
+    if(in.size() < r.body_start + r.body_size) return 0;
+    return r.body_start + r.body_size;
+}
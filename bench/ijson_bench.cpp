@@ -0,0 +1,411 @@
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "http_client.h"
+
+
+/*
+    Load generator: M clients and N workers over keep-alive connections.
+    make ijson-bench
+    ./bench/ijson-bench --clients 64 --workers 8 --mode worker --size 100 --duration 10 --pid `pidof ijson`
+
+    modes:
+        worker - workers use /rpc/worker (keep-alive, no id)
+        noid - workers use /rpc/add with option no_id and /rpc/result
+        id - workers use /rpc/add and /rpc/result with header Id
+*/
+
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8001;
+    int clients = 16;
+    int workers = 4;
+    int threads = 2;
+    int size = 100;
+    int methods = 1;
+    int duration = 10;
+    int warmup = 1;
+    int pid = 0;
+    std::string mode = "worker";
+};
+
+static Options opt;
+static std::atomic<bool> measuring{false};
+static std::atomic<bool> stopping{false};
+
+
+enum Step {
+    CLIENT_WAIT,  // response for a request
+    WORKER_WAIT_TASK,
+    WORKER_WAIT_ACK  // response for /rpc/result in noid and id modes
+};
+
+
+struct Conn {
+    int fd = -1;
+    bool worker = false;
+    int method = 0;
+    Step step;
+    std::string out;
+    size_t out_offset = 0;
+    std::string in;
+    u64 start = 0;
+};
+
+
+struct Stats {
+    std::vector<unsigned> latency;  // us
+    u64 requests = 0;
+    u64 errors = 0;
+};
+
+
+static std::string method_name(int n) {
+    return "bench/" + std::to_string(n);
+}
+
+static std::string worker_names() {
+    std::string names;
+    for(int i=0;i<opt.methods;i++) {
+        if(i) names += ",";
+        names += method_name(i);
+    }
+    return names;
+}
+
+static std::string payload() {
+    std::string params(opt.size > 20 ? opt.size - 20 : 1, 'x');
+    return "{\"params\": \"" + params + "\"}";
+}
+
+
+class Runner {
+public:
+    int epollfd;
+    std::vector<Conn*> conns;
+    Stats stats;
+    std::string request;
+    std::string result;
+
+    Runner() {
+        epollfd = epoll_create1(0);
+        request = payload();
+        result = "{\"result\": \"" + std::string(opt.size > 20 ? opt.size - 20 : 1, 'r') + "\"}";
+    }
+
+    void add(Conn *c) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+        conns.push_back(c);
+        flush(c);
+    }
+
+    void send(Conn *c, const std::string &data) {
+        c->out += data;
+        flush(c);
+    }
+
+    void flush(Conn *c) {
+        while(c->out_offset < c->out.size()) {
+            ssize_t n = ::send(c->fd, c->out.data() + c->out_offset, c->out.size() - c->out_offset, MSG_NOSIGNAL);
+            if(n < 0) {
+                if(errno != EAGAIN) stats.errors++;
+                return;
+            }
+            c->out_offset += n;
+        }
+        c->out.clear();
+        c->out_offset = 0;
+    }
+
+    void client_next(Conn *c) {
+        c->step = CLIENT_WAIT;
+        c->start = now_us();
+        send(c, http_post(method_name(c->method), request));
+    }
+
+    void worker_register(Conn *c) {
+        c->step = WORKER_WAIT_TASK;
+        std::string names = worker_names();
+        if(opt.mode == "worker") send(c, http_post("rpc/worker", "{\"name\": \"" + names + "\"}"));
+        else if(opt.mode == "noid") send(c, http_post("rpc/add", "{\"name\": \"" + names + "\", \"option\": \"no_id\"}"));
+        else send(c, http_post("rpc/add", "{\"name\": \"" + names + "\"}"));
+    }
+
+    void on_response(Conn *c, Response &r) {
+        if(c->worker) {
+            if(c->step == WORKER_WAIT_ACK) {
+                worker_register(c);
+                return;
+            }
+            if(r.code != 200) {
+                // 204 after worker timeout
+                worker_register(c);
+                return;
+            }
+            if(opt.mode == "worker") {
+                send(c, http_post("rpc/worker", result));
+            } else {
+                c->step = WORKER_WAIT_ACK;
+                if(opt.mode == "noid") send(c, http_post("rpc/result", result));
+                else send(c, http_post("rpc/result", result, "Id: " + r.id + "\r\n"));
+            }
+            return;
+        }
+
+        if(measuring) {
+            if(r.code == 200) {
+                stats.requests++;
+                stats.latency.push_back(now_us() - c->start);
+            } else stats.errors++;
+        }
+        if(!stopping) client_next(c);
+    }
+
+    void on_read(Conn *c) {
+        char buf[65536];
+        while(true) {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if(n > 0) {
+                c->in.append(buf, n);
+                continue;
+            }
+            if(n == 0 || errno != EAGAIN) {
+                stats.errors++;
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                c->fd = -1;
+            }
+            break;
+        }
+
+        Response r;
+        while(c->fd >= 0) {
+            size_t size = parse_response(c->in, r);
+            if(!size) break;
+            c->in.erase(0, size);
+            on_response(c, r);
+        }
+    }
+
+    void run() {
+        struct epoll_event events[256];
+        while(!stopping || pending()) {
+            int n = epoll_wait(epollfd, events, 256, 100);
+            for(int i=0;i<n;i++) {
+                Conn *c = (Conn*)events[i].data.ptr;
+                if(c->fd < 0) continue;
+                if(events[i].events & EPOLLOUT) flush(c);
+                if(events[i].events & EPOLLIN) on_read(c);
+            }
+            if(stopping && n == 0) break;
+        }
+    }
+
+    bool pending() {
+        for(auto c : conns) {
+            if(!c->worker && c->fd >= 0 && c->step == CLIENT_WAIT) return true;
+        }
+        return false;
+    }
+};
+
+
+struct ProcTimes {
+    std::vector<std::pair<std::string, u64>> threads;  // name, ticks
+    u64 total = 0;
+};
+
+static ProcTimes read_proc_times(int pid) {
+    ProcTimes result;
+    std::string dir = "/proc/" + std::to_string(pid) + "/task";
+    DIR *d = opendir(dir.c_str());
+    if(!d) return result;
+    struct dirent *e;
+    std::vector<int> tids;
+    while((e = readdir(d))) {
+        if(e->d_name[0] != '.') tids.push_back(atoi(e->d_name));
+    }
+    closedir(d);
+    std::sort(tids.begin(), tids.end());
+    for(int tid : tids) {
+        std::ifstream f(dir + "/" + std::to_string(tid) + "/stat");
+        std::string line;
+        std::getline(f, line);
+        size_t p = line.rfind(')');
+        if(p == std::string::npos) continue;
+        std::istringstream ss(line.substr(p + 2));
+        std::string field;
+        u64 utime = 0, stime = 0;
+        for(int i=3;i<=15;i++) {
+            ss >> field;
+            if(i == 14) utime = std::stoull(field);
+            if(i == 15) stime = std::stoull(field);
+        }
+        result.threads.push_back({std::to_string(tid), utime + stime});
+        result.total += utime + stime;
+    }
+    return result;
+}
+
+static long read_rss_kb(int pid) {
+    std::ifstream f("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while(std::getline(f, line)) {
+        if(line.compare(0, 6, "VmRSS:") == 0) return atol(line.c_str() + 6);
+    }
+    return 0;
+}
+
+
+static void usage() {
+    std::cout << "ijson-bench\n\
+    --host 127.0.0.1:8001\n\
+    --clients <number>, default 16\n\
+    --workers <number>, default 4\n\
+    --threads <number>, threads of the generator, default 2\n\
+    --mode worker|noid|id, default worker\n\
+    --size <bytes>, payload of a request and a result, default 100\n\
+    --methods <number>, requests are spread over bench/0..N-1, default 1\n\
+    --duration <sec>, default 10\n\
+    --warmup <sec>, default 1\n\
+    --pid <ijson pid>, to report rss and cpu\n";
+}
+
+
+int main(int argc, char **argv) {
+    for(int i=1;i<argc;i++) {
+        std::string key = argv[i];
+        if(key == "--help") {
+            usage();
+            return 0;
+        }
+        if(i + 1 >= argc) {
+            std::cout << "Wrong option " << key << "\n";
+            return 1;
+        }
+        std::string value = argv[++i];
+        if(key == "--host") {
+            size_t p = value.find(':');
+            if(p != std::string::npos) {
+                opt.port = atoi(value.c_str() + p + 1);
+                value = value.substr(0, p);
+            }
+            if(!value.empty()) opt.host = value;
+        } else if(key == "--clients") opt.clients = atoi(value.c_str());
+        else if(key == "--workers") opt.workers = atoi(value.c_str());
+        else if(key == "--threads") opt.threads = atoi(value.c_str());
+        else if(key == "--mode") opt.mode = value;
+        else if(key == "--size") opt.size = atoi(value.c_str());
+        else if(key == "--methods") opt.methods = atoi(value.c_str());
+        else if(key == "--duration") opt.duration = atoi(value.c_str());
+        else if(key == "--warmup") opt.warmup = atoi(value.c_str());
+        else if(key == "--pid") opt.pid = atoi(value.c_str());
+        else {
+            std::cout << "Wrong option " << key << "\n";
+            return 1;
+        }
+    }
+    if(opt.mode != "worker" && opt.mode != "noid" && opt.mode != "id") {
+        std::cout << "Wrong mode\n";
+        return 1;
+    }
+    if(opt.threads < 1 || opt.clients < 1 || opt.workers < 1 || opt.methods < 1) {
+        std::cout << "Wrong options\n";
+        return 1;
+    }
+
+    std::vector<Runner*> runners;
+    for(int i=0;i<opt.threads;i++) runners.push_back(new Runner());
+
+    // workers first, so clients don't get 404
+    for(int i=0;i<opt.workers;i++) {
+        Conn *c = new Conn();
+        c->worker = true;
+        c->fd = connect_to(opt.host, opt.port);
+        if(c->fd < 0) {
+            std::cout << "Can't connect to " << opt.host << ":" << opt.port << "\n";
+            return 1;
+        }
+        Runner *r = runners[i % opt.threads];
+        r->worker_register(c);
+        r->add(c);
+    }
+    usleep(200000);
+    for(int i=0;i<opt.clients;i++) {
+        Conn *c = new Conn();
+        c->method = i % opt.methods;
+        c->fd = connect_to(opt.host, opt.port);
+        if(c->fd < 0) {
+            std::cout << "Can't connect\n";
+            return 1;
+        }
+        Runner *r = runners[i % opt.threads];
+        r->client_next(c);
+        r->add(c);
+    }
+
+    std::vector<std::thread> threads;
+    for(auto r : runners) threads.emplace_back(&Runner::run, r);
+
+    sleep(opt.warmup);
+    ProcTimes cpu_start;
+    if(opt.pid) cpu_start = read_proc_times(opt.pid);
+    u64 start = now_us();
+    measuring = true;
+    sleep(opt.duration);
+    measuring = false;
+    u64 elapsed = now_us() - start;
+    ProcTimes cpu_end;
+    long rss = 0;
+    if(opt.pid) {
+        cpu_end = read_proc_times(opt.pid);
+        rss = read_rss_kb(opt.pid);
+    }
+    stopping = true;
+    for(auto &t : threads) t.join();
+
+    Stats total;
+    for(auto r : runners) {
+        total.requests += r->stats.requests;
+        total.errors += r->stats.errors;
+        total.latency.insert(total.latency.end(), r->stats.latency.begin(), r->stats.latency.end());
+    }
+    std::sort(total.latency.begin(), total.latency.end());
+
+    double sec = elapsed / 1e6;
+    std::cout << "mode " << opt.mode << ", clients " << opt.clients << ", workers " << opt.workers
+        << ", methods " << opt.methods << ", payload " << opt.size << "b, " << opt.duration << "s\n";
+    std::cout << "requests " << total.requests << ", " << (u64)(total.requests / sec) << " rps, errors " << total.errors << "\n";
+    if(total.latency.size()) {
+        auto pct = [&](double p) {
+            size_t i = (size_t)(p * (total.latency.size() - 1));
+            return total.latency[i];
+        };
+        std::cout << "latency us: p50 " << pct(0.5) << ", p90 " << pct(0.9) << ", p99 " << pct(0.99)
+            << ", p99.9 " << pct(0.999) << ", max " << total.latency.back() << "\n";
+    }
+    if(opt.pid) {
+        long hz = sysconf(_SC_CLK_TCK);
+        std::cout << "ijson: rss " << rss / 1024.0 << " MB, cpu " << (int)((cpu_end.total - cpu_start.total) * 100.0 / hz / sec) << "%\n";
+        for(auto &t : cpu_end.threads) {
+            u64 before = 0;
+            for(auto &s : cpu_start.threads) if(s.first == t.first) before = s.second;
+            int usage = (int)((t.second - before) * 100.0 / hz / sec);
+            if(usage) std::cout << "  thread " << t.first << ": " << usage << "%\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+
+#include <iostream>
+#include <time.h>
+#include "../src/json.h"
+
+
+/*
+    Envelope scan benchmark, the id is placed after a big params object.
+    make bench_json && ./bench/json_scan
+    make bench_json_nosimd && ./bench/json_scan.nosimd
+*/
+
+
+static u64 now_ns() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (u64)spec.tv_sec * 1'000'000'000 + (u64)spec.tv_nsec;
+}
+
+
+void make_envelope(Buffer &r, int size) {
+    r.clear();
+    r.add("{\"jsonrpc\": \"2.0\", \"method\": \"test/command\", \"params\": {\"items\": [");
+    int n = 0;
+    while(r.size() < size) {
+        if(n) r.add(", ");
+        r.add("{\"n\": ");
+        r.add_number(n++);
+        r.add(", \"name\": \"item \\\"quoted\\\" {x}\", \"tags\": [\"a\", \"b\", [1, 2, {\"c\": null}]], \"path\": \"c:\\\\tmp\\\\\"}");
+    }
+    r.add("]}, \"id\": 123456}");
+}
+
+
+void run(const char *title, int size) {
+    Buffer data;
+    make_envelope(data, size);
+
+    int repeat = 200'000'000 / data.size();
+    if(repeat < 5) repeat = 5;
+
+    JsonEnvelope env;
+    env.load(data);
+    if(env.id != "123456" || env.invalid) {
+        std::cout << title << ": wrong result\n";
+        return;
+    }
+
+    u64 start = now_ns();
+    for(int i=0;i<repeat;i++) env.load(data);
+    u64 duration = now_ns() - start;
+
+    double ns = (double)duration / repeat;
+    double mbs = (double)data.size() * repeat / 1'048'576 / ((double)duration / 1e9);
+    std::cout << title << "\t" << data.size() << " b\t" << (u64)ns << " ns/op\t" << (u64)mbs << " MB/s\n";
+}
+
+
+int main() {
+    #ifdef NO_SIMD
+        std::cout << "scalar\n";
+    #else
+        std::cout << "simd\n";
+    #endif
+    run("1KB", 1024);
+    run("100KB", 100 * 1024);
+    run("10MB", 10 * 1024 * 1024);
+    return 0;
+}
@@ -0,0 +1,87 @@
+import sys
+import time
+import socket
+import argparse
+import threading
+import requests
+
+
+"""
+    Streams a large worker result to a throttled client.
+
+    ./ijson --log 0 &
+    python3 bench/large_result.py --size 50 --pid $!
+"""
+
+
+def cpu_time(pid):
+    if not pid:
+        return 0
+    with open(f'/proc/{pid}/stat') as f:
+        parts = f.read().rsplit(')', 1)[1].split()
+    return (int(parts[11]) + int(parts[12])) / 100  # utime + stime, in ticks of 10ms
+
+
+def worker(url, size):
+    s = requests.Session()
+    r = s.post(url + '/rpc/add', json={'name': 'bench/large', 'option': 'no_id'})
+    assert r.status_code == 200
+    s.post(url + '/rpc/result', data=b'x' * size)
+
+
+def client(host, port, size, rcvbuf, chunk, delay):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+    sock.connect((host, port))
+    sock.sendall(b'POST /bench/large HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}')
+    received = 0
+    header = b''
+    while True:
+        data = sock.recv(chunk)
+        if not data:
+            break
+        received += len(data)
+        if len(header) < 256:
+            header += data[:256]
+        if received >= size:
+            break
+        if delay:
+            time.sleep(delay)
+    sock.close()
+    assert header.startswith(b'HTTP/1.1 200'), header[:64]
+    return received
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8001)
+    parser.add_argument('--size', type=int, default=50, help='result size, Mb')
+    parser.add_argument('--rcvbuf', type=int, default=16384)
+    parser.add_argument('--chunk', type=int, default=16384)
+    parser.add_argument('--delay', type=float, default=0, help='sleep between reads, sec')
+    parser.add_argument('--pid', type=int, default=0, help='ijson pid to report cpu time')
+    args = parser.parse_args()
+
+    url = f'http://{args.host}:{args.port}'
+    size = args.size * 1024 * 1024
+
+    th = threading.Thread(target=worker, args=(url, size))
+    th.start()
+    time.sleep(0.2)
+
+    cpu = cpu_time(args.pid)
+    start = time.time()
+    received = client(args.host, args.port, size, args.rcvbuf, args.chunk, args.delay)
+    duration = time.time() - start
+    cpu = cpu_time(args.pid) - cpu
+    th.join()
+
+    print(f'{received / 1048576:.1f} Mb in {duration:.2f} sec, {received / 1048576 / duration:.1f} Mb/s', end='')
+    if args.pid:
+        print(f', ijson cpu {cpu:.2f} sec', end='')
+    print()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
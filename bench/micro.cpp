@@ -0,0 +1,285 @@
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "../src/server.h"
+#include "../src/connect.h"
+#include "../src/json.h"
+
+
+/*
+    Microbenchmarks of hot primitives, one json line per benchmark:
+    {"bench": "mapper.find/hit_1000", "ns_per_op": 12.5, "ops": 16777216}
+
+    make bench_micro && ./bench/micro [filter] > after.jsonl
+    python3 bench/compare.py before.jsonl after.jsonl
+*/
+
+
+static u64 now_ns() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (u64)spec.tv_sec * 1'000'000'000 + (u64)spec.tv_nsec;
+}
+
+static const char *filter = NULL;
+static volatile u64 sink = 0;
+
+
+void run(const char *name, std::function<u64(u64)> fn) {
+    // doubles the count until a run takes 200ms, best of 3
+    if(filter && !strstr(name, filter)) return;
+    u64 ops = 1;
+    u64 time;
+    while(true) {
+        u64 start = now_ns();
+        sink += fn(ops);
+        time = now_ns() - start;
+        if(time > 200'000'000 || ops >= (1ULL << 32)) break;
+        ops *= 2;
+    }
+    for(int i=0;i<2;i++) {
+        u64 start = now_ns();
+        sink += fn(ops);
+        u64 t = now_ns() - start;
+        if(t < time) time = t;
+    }
+    char line[256];
+    snprintf(line, sizeof(line), "{\"bench\": \"%s\", \"ns_per_op\": %.2f, \"ops\": %llu}\n", name, (double)time / ops, (unsigned long long)ops);
+    std::cout << line << std::flush;
+}
+
+
+u64 rnd(u64 &seed) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+}
+
+
+void bench_mapper(Server *server) {
+    // names are added to the server mapper once, the map only grows
+    std::vector<std::string> short_names, long_names, misses;
+    for(int i=0;i<100;i++) short_names.push_back("m" + std::to_string(i));
+    for(int i=0;i<1000;i++) long_names.push_back("service/tenant_" + std::to_string(i % 50) + "/method_" + std::to_string(i));
+    for(int i=0;i<1000;i++) misses.push_back("service/tenant_" + std::to_string(i % 50) + "/missing_" + std::to_string(i));
+
+    Mapper mapper(server);
+    int value = 1;
+    for(auto &n : short_names) mapper.add(Slice(n.c_str()), value++);
+    for(auto &n : long_names) mapper.add(Slice(n.c_str()), value++);
+
+    run("mapper.find/hit_short_100", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) r += mapper.find(Slice(short_names[i % short_names.size()].c_str()));
+        return r;
+    });
+    run("mapper.find/hit_prefix_1000", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) r += mapper.find(Slice(long_names[i % long_names.size()].c_str()));
+        return r;
+    });
+    run("mapper.find/miss_prefix_1000", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) r += mapper.find(Slice(misses[i % misses.size()].c_str()));
+        return r;
+    });
+    run("mapper.add/new_1000", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;) {
+            Mapper m(server);
+            for(int j=0;j<1000 && i<n;j++, i++) m.add(Slice(long_names[j].c_str()), j + 1);
+            r += m.find(Slice(long_names[0].c_str()));
+        }
+        return r;
+    });
+}
+
+
+void bench_json() {
+    const char *call = "{\"jsonrpc\": \"2.0\", \"method\": \"test/command\", \"params\": {\"name\": \"user\", \"age\": 42, \"tags\": [\"a\", \"b\"]}, \"id\": 15}";
+    const char *add = "{\"name\": \"test/command\", \"option\": \"no_id\", \"info\": \"test worker\", \"limits\": {\"queue\": 100}}";
+    Buffer big;
+    big.add("{\"method\": \"test/command\", \"params\": [");
+    for(int i=0;i<1000;i++) {
+        if(i) big.add(", ");
+        big.add("{\"n\": ");
+        big.add_number(i);
+        big.add(", \"text\": \"quoted \\\"value\\\" {x}\"}");
+    }
+    big.add("], \"id\": 7}");
+
+    run("json.scan/rpc_call", [&](u64 n) {
+        u64 r = 0;
+        Slice data(call);
+        for(u64 i=0;i<n;i++) {
+            Json json(data);
+            while(json.scan()) r += json.value.size();
+        }
+        return r;
+    });
+    run("json.scan/rpc_add", [&](u64 n) {
+        u64 r = 0;
+        Slice data(add);
+        for(u64 i=0;i<n;i++) {
+            Json json(data);
+            while(json.scan()) r += json.value.size();
+        }
+        return r;
+    });
+    run("json.scan/params_40kb", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            Json json(big);
+            while(json.scan()) r += json.value.size();
+        }
+        return r;
+    });
+    run("json.envelope/rpc_call", [&](u64 n) {
+        u64 r = 0;
+        Slice data(call);
+        for(u64 i=0;i<n;i++) {
+            JsonEnvelope e;
+            e.load(data);
+            r += e.id.size();
+        }
+        return r;
+    });
+}
+
+
+void bench_buffer() {
+    run("buffer.add/small", [&](u64 n) {
+        Buffer b;
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            if((i & 1023) == 0) b.clear();
+            b.add("Content-Length: ");
+        }
+        r += b.size();
+        return r;
+    });
+    run("buffer.add_number", [&](u64 n) {
+        Buffer b;
+        for(u64 i=0;i<n;i++) {
+            if((i & 1023) == 0) b.clear();
+            b.add_number(i * 7919);
+        }
+        return (u64)b.size();
+    });
+    run("buffer.resize/grow_64kb", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            Buffer b;
+            for(int size=64;size<=65536;size*=2) b.resize(size);
+            r += b.get_capacity();
+        }
+        return r;
+    });
+    run("buffer.new/inline", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            Buffer b(16);
+            b.add("test/command");
+            r += b.size();
+        }
+        return r;
+    });
+}
+
+
+void bench_http(Server *server) {
+    Loop *loop = new Loop(server, 0);
+    server->loops[0] = loop;
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) THROW("socketpair");
+    Connect *conn = new Connect(server, sv[0]);
+    conn->link();
+    loop->accept(conn);
+
+    std::string request = "POST /echo HTTP/1.1\r\nHost: localhost:8001\r\nUser-Agent: bench\r\nAccept: */*\r\nContent-Type: application/json\r\nContent-Length: 64\r\n\r\n";
+    request += std::string(64, 'x');
+    std::vector<char> data(request.begin(), request.end());
+
+    run("http.on_recv/whole", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            conn->on_recv(data.data(), data.size());
+            r += conn->send_buffer.size();
+            conn->send_buffer.clear();
+        }
+        return r;
+    });
+    run("http.on_recv/fragments_16b", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            for(size_t p=0;p<data.size();p+=16) {
+                size_t size = data.size() - p < 16 ? data.size() - p : 16;
+                conn->on_recv(&data[p], size);
+            }
+            r += conn->send_buffer.size();
+            conn->send_buffer.clear();
+        }
+        return r;
+    });
+
+    Buffer body(256);
+    body.add("{\"jsonrpc\": \"2.0\", \"result\": {\"name\": \"user\", \"age\": 42}, \"id\": 15}");
+    Slice id("15");
+    run("http.sender/response", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            conn->send.status("200 OK")->header("Id", id)->done(body);
+            r += conn->send_buffer.size();
+            conn->send_buffer.clear();
+        }
+        return r;
+    });
+}
+
+
+void bench_netfilter() {
+    std::vector<NetFilter> filters;
+    const char *masks[] = {"10.0.0.0/8", "172.16.0.0/12", "192.168.0.0/16", "127.0.0.1/32"};
+    for(auto m : masks) {
+        Slice s(m);
+        filters.push_back(NetFilter(s));
+    }
+    std::vector<u32> ips;
+    u64 seed = 1;
+    for(int i=0;i<1024;i++) ips.push_back((u32)rnd(seed));
+
+    run("netfilter.match/4_rules", [&](u64 n) {
+        u64 r = 0;
+        for(u64 i=0;i<n;i++) {
+            u32 ip = ips[i & 1023];
+            for(auto &f : filters) {
+                if(f.match(ip)) {
+                    r++;
+                    break;
+                }
+            }
+        }
+        return r;
+    });
+}
+
+
+int main(int argc, char **argv) {
+    if(argc > 1) filter = argv[1];
+
+    Server *server = new Server();
+    server->log = 0;
+    Loop *loops[1] = {NULL};
+    server->loops = loops;
+
+    bench_mapper(server);
+    bench_json();
+    bench_buffer();
+    bench_http(server);
+    bench_netfilter();
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Workload for a profile of make pgo: ./bench/pgo_train.sh build/pgo-gen/ijson
+# clients and workers in all modes, small, medium and large payloads.
+# The profile is written when ijson gets SIGTERM.
+
+IJSON=$1
+PORT=8011
+BENCH="./bench/ijson-bench --host 127.0.0.1:$PORT --duration 1 --warmup 0 --methods 4"
+
+$IJSON --host 127.0.0.1:$PORT --log 0 --threads 2 &
+PID=$!
+sleep 0.3
+
+for mode in worker noid id; do
+    $BENCH --mode $mode --size 100 --clients 32 --workers 8 > /dev/null
+    $BENCH --mode $mode --size 4000 --clients 16 --workers 4 > /dev/null
+done
+# mixed sizes at once
+$BENCH --mode worker --size 200 --clients 16 --workers 4 > /dev/null &
+MIXED=$!
+$BENCH --mode noid --size 64000 --clients 4 --workers 2 > /dev/null
+wait $MIXED
+
+kill $PID
+wait $PID
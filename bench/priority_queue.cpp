@@ -0,0 +1,75 @@
+
+#include <iostream>
+#include <deque>
+#include <vector>
+#include <time.h>
+#include "../src/server.h"
+#include "../src/connect.h"
+
+
+/*
+    Waiting clients queue benchmark, 100k clients with mixed priorities.
+    make bench_queue && ./bench/priority_queue
+*/
+
+
+static u64 now_ns() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (u64)spec.tv_sec * 1'000'000'000 + (u64)spec.tv_nsec;
+}
+
+
+// previous implementation: sorted insert into a deque
+static void deque_push(std::deque<Connect*> &clients, Connect *client) {
+    for(auto it=clients.crbegin(); it!=clients.crend(); it++) {
+        if(client->priority <= (*it)->priority) {
+            clients.insert(it.base(), client);
+            return;
+        }
+    }
+    clients.push_front(client);
+}
+
+
+int main() {
+    const int count = 100'000;
+    Server *server = new Server();
+    Loop *loops[1] = {NULL};
+    server->loops = loops;
+
+    std::vector<Connect*> clients;
+    u64 seed = 1;
+    for(int i=0;i<count;i++) {
+        Connect *c = new Connect(server, i);
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        c->priority = (int)(seed >> 60) - 8;  // -8..7
+        clients.push_back(c);
+    }
+
+    u64 start = now_ns();
+    std::deque<Connect*> dq;
+    for(auto c : clients) deque_push(dq, c);
+    u64 check_deque = 0;
+    while(dq.size()) {
+        check_deque = check_deque * 31 + dq.front()->fd;
+        dq.pop_front();
+    }
+    u64 deque_time = now_ns() - start;
+
+    start = now_ns();
+    ClientQueue cq;
+    for(auto c : clients) cq.push(c);
+    u64 check_queue = 0;
+    while(cq.size()) check_queue = check_queue * 31 + cq.pop()->fd;
+    u64 queue_time = now_ns() - start;
+
+    std::cout << count << " clients, push + pop\n";
+    std::cout << "  deque insert: " << deque_time / 1000000.0 << " ms\n";
+    std::cout << "  ClientQueue:  " << queue_time / 1000000.0 << " ms\n";
+    if(check_deque != check_queue) {
+        std::cout << "  order mismatch\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,434 @@
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <queue>
+#include <algorithm>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include "http_client.h"
+#include "../src/capture.h"
+
+
+/*
+    Replays a capture of ijson --capture <path> with original timing.
+    make replay
+    ./bench/replay --capture /tmp/cap --speed 2 --workers 8
+
+    Requests from all files <path>.0, <path>.1 ... are merged by time and sent open-loop:
+    a request is sent at its time / speed even if previous ones are not answered.
+    Workers are simulated, they serve every captured method and reply with
+    the mean captured result size of the method after --service us.
+*/
+
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8001;
+    std::string capture;
+    double speed = 1;  // 0 - as fast as possible
+    int workers = 8;
+    int connections = 256;  // max client connections
+    int service = 0;  // us
+    int timeout = 10;  // sec, to wait for answers after the last request
+};
+
+static Options opt;
+
+
+struct Request {
+    u64 time;  // us from the capture start
+    std::string method;
+    std::string body;
+};
+
+
+struct MethodInfo {
+    u64 results = 0;
+    u64 result_bytes = 0;
+    std::string result;
+};
+
+
+static std::vector<Request> requests;
+static std::map<std::string, MethodInfo> methods;
+
+
+static std::string synthetic(size_t size) {
+    std::string params(size > 16 ? size - 16 : 1, 'x');
+    return "{\"params\": \"" + params + "\"}";
+}
+
+
+static bool load_file(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    if(size < sizeof(CaptureHeader)) {
+        close(fd);
+        return true;
+    }
+    char *data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return false;
+    if(memcmp(((CaptureHeader*)data)->magic, CAPTURE_MAGIC, 8)) {
+        std::cout << path << ": wrong format\n";
+        munmap(data, size);
+        return true;
+    }
+
+    size_t pos = sizeof(CaptureHeader);
+    while(pos + sizeof(CaptureRecord) <= size) {
+        size_t window_end = (pos / CAPTURE_WINDOW + 1) * CAPTURE_WINDOW;
+        if(window_end - pos < sizeof(CaptureRecord)) {
+            pos = window_end;
+            continue;
+        }
+        CaptureRecord *r = (CaptureRecord*)(data + pos);
+        if(r->size == 0 || pos + r->size > size) break;
+        if(r->type != CAPTURE_PADDING) {
+            const char *p = data + pos + sizeof(CaptureRecord);
+            std::string method(p, r->method_size);
+            p += r->method_size + r->id_size;
+            if(r->type == CAPTURE_REQUEST) {
+                Request req;
+                req.time = r->time;
+                req.method = method;
+                if(r->stored_size == r->body_size && r->body_size) req.body.assign(p, r->stored_size);
+                else req.body = synthetic(r->body_size);
+                requests.push_back(std::move(req));
+                methods[method];
+            } else if(r->type == CAPTURE_RESULT) {
+                auto &m = methods[method];
+                m.results++;
+                m.result_bytes += r->body_size;
+            }
+        }
+        pos += r->size;
+    }
+    munmap(data, size);
+    return true;
+}
+
+
+enum Step {
+    IDLE,
+    CLIENT_WAIT,
+    WORKER_WAIT_TASK,
+    WORKER_SERVING
+};
+
+
+struct Conn {
+    int fd = -1;
+    bool worker = false;
+    Step step = IDLE;
+    std::string out;
+    size_t out_offset = 0;
+    std::string in;
+    u64 start = 0;  // planned time of a request
+    std::string method;  // current task of a worker
+};
+
+
+struct Stats {
+    std::vector<unsigned> latency;  // us, from the planned time, or from sending with speed 0
+    std::vector<unsigned> lag;  // us, sent later than planned
+    u64 sent = 0;
+    u64 completed = 0;
+    u64 errors = 0;
+};
+
+
+class Replay {
+public:
+    int epollfd;
+    Stats stats;
+    std::vector<Conn*> idle;
+    int client_count = 0;
+    std::string names;
+    u64 start = 0;
+    // workers which reply later, by time
+    typedef std::pair<u64, Conn*> Due;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> serving;
+
+    Replay() {
+        epollfd = epoll_create1(0);
+        for(auto &it : methods) {
+            if(!names.empty()) names += ",";
+            names += it.first;
+            auto &m = it.second;
+            m.result = synthetic(m.results ? m.result_bytes / m.results : 16);
+        }
+    }
+
+    void add(Conn *c) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+        flush(c);
+    }
+
+    void send(Conn *c, const std::string &data) {
+        c->out += data;
+        flush(c);
+    }
+
+    void flush(Conn *c) {
+        while(c->out_offset < c->out.size()) {
+            ssize_t n = ::send(c->fd, c->out.data() + c->out_offset, c->out.size() - c->out_offset, MSG_NOSIGNAL);
+            if(n < 0) {
+                if(errno != EAGAIN) stats.errors++;
+                return;
+            }
+            c->out_offset += n;
+        }
+        c->out.clear();
+        c->out_offset = 0;
+    }
+
+    void drop(Conn *c) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        if(c->worker) return;
+        if(c->step == CLIENT_WAIT) stats.errors++;
+        client_count--;
+    }
+
+    void worker_register(Conn *c) {
+        c->step = WORKER_WAIT_TASK;
+        send(c, http_post("rpc/worker", "{\"name\": \"" + names + "\"}"));
+    }
+
+    void worker_reply(Conn *c) {
+        c->step = WORKER_WAIT_TASK;
+        send(c, http_post("rpc/worker", methods[c->method].result));
+    }
+
+    bool client_send(const Request &req, u64 planned, u64 now) {
+        Conn *c = NULL;
+        if(idle.size()) {
+            c = idle.back();
+            idle.pop_back();
+        } else {
+            if(client_count >= opt.connections) return false;
+            c = new Conn();
+            c->fd = connect_to(opt.host, opt.port);
+            if(c->fd < 0) {
+                delete c;
+                stats.errors++;
+                return true;
+            }
+            client_count++;
+            add(c);
+        }
+        c->step = CLIENT_WAIT;
+        stats.sent++;
+        if(opt.speed > 0) {
+            c->start = planned;
+            stats.lag.push_back(now - planned);
+        } else c->start = now;
+        send(c, http_post(req.method, req.body));
+        return true;
+    }
+
+    void on_response(Conn *c, Response &r) {
+        if(c->worker) {
+            if(r.code != 200 || r.name.empty()) {
+                // 204 after worker timeout
+                worker_register(c);
+                return;
+            }
+            c->method = r.name;
+            if(opt.service) {
+                c->step = WORKER_SERVING;
+                serving.push({now_us() + opt.service, c});
+            } else worker_reply(c);
+            return;
+        }
+
+        if(r.code == 200) {
+            stats.completed++;
+            stats.latency.push_back(now_us() - c->start);
+        } else stats.errors++;
+        c->step = IDLE;
+        idle.push_back(c);
+    }
+
+    void on_read(Conn *c) {
+        char buf[65536];
+        while(true) {
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if(n > 0) {
+                c->in.append(buf, n);
+                continue;
+            }
+            if(n == 0 || errno != EAGAIN) drop(c);
+            break;
+        }
+
+        Response r;
+        while(c->fd >= 0) {
+            size_t size = parse_response(c->in, r);
+            if(!size) break;
+            c->in.erase(0, size);
+            on_response(c, r);
+        }
+    }
+
+    u64 planned(size_t i) {
+        if(opt.speed <= 0) return start;
+        return start + (u64)((requests[i].time - requests[0].time) / opt.speed);
+    }
+
+    void run() {
+        struct epoll_event events[256];
+        size_t next = 0;
+        start = now_us();
+        u64 deadline = 0;
+        while(true) {
+            u64 now = now_us();
+            while(next < requests.size() && planned(next) <= now) {
+                if(!client_send(requests[next], planned(next), now)) break;
+                next++;
+            }
+            while(serving.size() && serving.top().first <= now) {
+                Conn *c = serving.top().second;
+                serving.pop();
+                if(c->fd >= 0) worker_reply(c);
+            }
+            if(next == requests.size()) {
+                if(stats.completed + stats.errors >= stats.sent) break;
+                if(!deadline) deadline = now + (u64)opt.timeout * 1000000;
+                if(now > deadline) break;
+            }
+
+            // wake up for the next request or a worker reply
+            u64 wake = now + 100000;
+            if(next < requests.size() && (idle.size() || client_count < opt.connections)) wake = std::min(wake, planned(next));
+            if(serving.size()) wake = std::min(wake, serving.top().first);
+            int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+            int n = epoll_wait(epollfd, events, 256, timeout);
+            for(int i=0;i<n;i++) {
+                Conn *c = (Conn*)events[i].data.ptr;
+                if(c->fd < 0) continue;
+                if(events[i].events & EPOLLOUT) flush(c);
+                if(events[i].events & EPOLLIN) on_read(c);
+            }
+        }
+    }
+};
+
+
+static void usage() {
+    std::cout << "ijson replay\n\
+    --capture <path>, files <path>.0, <path>.1 ... of ijson --capture\n\
+    --host <host:port>, default 127.0.0.1:8001\n\
+    --speed <x>, 2 - twice faster than captured, 0 - as fast as possible, default 1\n\
+    --workers <number>, simulated workers, default 8\n\
+    --service <us>, time of a worker to serve a request, default 0\n\
+    --connections <number>, max client connections, default 256\n\
+    --timeout <sec>, to wait for answers after the last request, default 10\n";
+}
+
+
+static unsigned percentile(std::vector<unsigned> &v, double p) {
+    return v[(size_t)(p * (v.size() - 1))];
+}
+
+
+int main(int argc, char **argv) {
+    for(int i=1;i<argc;i++) {
+        std::string key = argv[i];
+        if(key == "--help") {
+            usage();
+            return 0;
+        }
+        if(i + 1 >= argc) {
+            std::cout << "Wrong option " << key << "\n";
+            return 1;
+        }
+        std::string value = argv[++i];
+        if(key == "--host") {
+            size_t p = value.find(':');
+            if(p != std::string::npos) {
+                opt.port = atoi(value.c_str() + p + 1);
+                value = value.substr(0, p);
+            }
+            if(!value.empty()) opt.host = value;
+        } else if(key == "--capture") opt.capture = value;
+        else if(key == "--speed") opt.speed = atof(value.c_str());
+        else if(key == "--workers") opt.workers = atoi(value.c_str());
+        else if(key == "--service") opt.service = atoi(value.c_str());
+        else if(key == "--connections") opt.connections = atoi(value.c_str());
+        else if(key == "--timeout") opt.timeout = atoi(value.c_str());
+        else {
+            std::cout << "Wrong option " << key << "\n";
+            return 1;
+        }
+    }
+    if(opt.capture.empty() || opt.workers < 1 || opt.connections < 1) {
+        usage();
+        return 1;
+    }
+
+    int files = 0;
+    while(load_file(opt.capture + "." + std::to_string(files))) files++;
+    if(!files) {
+        std::cout << "No files " << opt.capture << ".N\n";
+        return 1;
+    }
+    std::stable_sort(requests.begin(), requests.end(), [](const Request &a, const Request &b) {
+        return a.time < b.time;
+    });
+    if(requests.empty()) {
+        std::cout << "No requests in capture\n";
+        return 1;
+    }
+    u64 span = requests.back().time - requests.front().time;
+    std::cout << "files " << files << ", requests " << requests.size() << ", methods " << methods.size()
+        << ", captured " << span / 1000 << " ms\n";
+
+    Replay replay;
+    for(int i=0;i<opt.workers;i++) {
+        Conn *c = new Conn();
+        c->worker = true;
+        c->fd = connect_to(opt.host, opt.port);
+        if(c->fd < 0) {
+            std::cout << "Can't connect to " << opt.host << ":" << opt.port << "\n";
+            return 1;
+        }
+        replay.worker_register(c);
+        replay.add(c);
+    }
+    usleep(200000);
+
+    u64 begin = now_us();
+    replay.run();
+    u64 elapsed = now_us() - begin;
+
+    Stats &s = replay.stats;
+    double sec = elapsed / 1e6;
+    std::cout << "sent " << s.sent << ", completed " << s.completed << ", errors " << s.errors
+        << ", lost " << (s.sent - std::min(s.sent, s.completed + s.errors)) << ", " << elapsed / 1000 << " ms, "
+        << (u64)(s.completed / sec) << " rps\n";
+    if(s.latency.size()) {
+        std::sort(s.latency.begin(), s.latency.end());
+        std::cout << "latency us: p50 " << percentile(s.latency, 0.5) << ", p90 " << percentile(s.latency, 0.9)
+            << ", p99 " << percentile(s.latency, 0.99) << ", max " << s.latency.back() << "\n";
+    }
+    if(s.lag.size()) {
+        std::sort(s.lag.begin(), s.lag.end());
+        std::cout << "send lag us: p50 " << percentile(s.lag, 0.5) << ", p99 " << percentile(s.lag, 0.99)
+            << ", max " << s.lag.back() << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+
+
+/*
+    Placement of threads by /sys topology, without libnuma:
+    a thread is pinned by sched_setaffinity and prefers memory of its node (set_mempolicy),
+    so pages touched by a loop (pools, buffers, stack) come from the local node.
+*/
+
+
+bool parse_cpu_list(const char *s, std::vector<int> &result) {
+    // "0-3,8,10-11"
+    result.clear();
+    while(*s && *s != '\n') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        if(end == s || first < 0 || first >= CPU_SETSIZE) return false;
+        long last = first;
+        s = end;
+        if(*s == '-') {
+            s++;
+            last = strtol(s, &end, 10);
+            if(end == s || last < first || last >= CPU_SETSIZE) return false;
+            s = end;
+        }
+        for(long i=first;i<=last;i++) result.push_back(i);
+        if(*s == ',') s++;
+        else if(*s && *s != '\n') return false;
+    }
+    return result.size() > 0;
+}
+
+static bool read_list(const std::string &path, std::vector<int> &result) {
+    char line[4096];
+    FILE *f = fopen(path.c_str(), "r");
+    if(!f) return false;
+    bool ok = fgets(line, sizeof(line), f) && parse_cpu_list(line, result);
+    fclose(f);
+    return ok;
+}
+
+int numa_nodes() {
+    std::vector<int> nodes;
+    if(!read_list("/sys/devices/system/node/online", nodes)) return 1;
+    return nodes.back() + 1;
+}
+
+int cpu_node(int cpu) {
+    int nodes = numa_nodes();
+    for(int node=0;node<nodes;node++) {
+        std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpu" + std::to_string(cpu);
+        if(access(path.c_str(), F_OK) == 0) return node;
+    }
+    return 0;
+}
+
+bool node_cpus(int node, std::vector<int> &result) {
+    return read_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", result);
+}
+
+bool pin_thread(const std::vector<int> &cpus) {
+    // the calling thread
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus) CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool prefer_node(int node) {
+    // the calling thread, other nodes are used when the node is full
+    if(node < 0 || node >= 64) return false;
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) == 0;
+}
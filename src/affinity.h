@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+
+#define LOOP_HOT 80  // % of cpu, new connections avoid a loop over it
+
+
+bool parse_cpu_list(const char *s, std::vector<int> &result);
+int numa_nodes();
+int cpu_node(int cpu);
+bool node_cpus(int node, std::vector<int> &result);
+bool pin_thread(const std::vector<int> &cpus);
+bool prefer_node(int node);
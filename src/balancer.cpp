@@ -33,6 +33,7 @@ void Balancer::_start() {
     u64 *used = new u64[threads]();
     int *cpu = new int[threads]();
     u64 prev_time = get_ntime();
+    if(server->cpus.size()) pin_thread(server->cpus);
 
     while(true) {
         usleep(500'000);  // 500ms
@@ -47,7 +48,8 @@ void Balancer::_start() {
             struct timespec thread_time;
             clockid_t threadClockId;
 
-            if(log) std::cout << "cpu: ";
+            Buffer line(64);
+            line.add("cpu: ");
             u64 total = 0;
             for(int i=0; i<threads; i++) {
                 auto id = server->loops[i]->get_id();
@@ -57,15 +59,21 @@ void Balancer::_start() {
                 cpu[i] = (usage - used[i]) * 100 / frame;
                 used[i] = usage;
 
-                if(log) std::cout << cpu[i] << "% ";
+                line.add_number(cpu[i]);
+                line.add("% ");
             }
-            if(log) std::cout << std::endl;
+            if(log) Log(64) << line;
 
             int active = -1;
             int min = 0;
+            u64 hot = 0;
+            for(int i=0;i<threads;i++) {
+                if(cpu[i] > LOOP_HOT) hot |= 1ULL << i;
+            }
+            server->hot_loops = hot;
             for(int i=0;i<threads;i++) {
                 if(cpu[i] < cpu[min]) min = i;
-                if(cpu[i] > 80) continue;
+                if(cpu[i] > LOOP_HOT) continue;
                 active = i;
                 break;
             }
@@ -73,7 +81,7 @@ void Balancer::_start() {
             if(active == -1) active = min;
             if(server->active_loop != active) {
                 server->active_loop = active;
-                if(log) std::cout << "Active loop: " << active << std::endl;
+                if(log) Log(64) << "Active loop: " << active;
             }
         }
     };
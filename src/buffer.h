@@ -130,9 +130,13 @@ public:
         _size = i + 1;
     }
     int atoi() {
+        return atol();
+    }
+    i64 atol() {
         char *p = ptr();
         if(!_size) throw error::NoData();
-        int value = 0, i = 0, n;
+        i64 value = 0;
+        int i = 0, n;
         bool negative = false;
         if(p[0] == '-') {
             negative = true;
@@ -150,20 +154,20 @@ public:
 };
 
 
+#define BUFFER_INLINE 40
+
+
 class Buffer : public ISlice {
 protected:
     int _cap = 0;
+    char _inline[BUFFER_INLINE];
 
     int _get_cap(int size) {
-        int cap = 16;
-        int step = 16;
-        while(cap < size) {
-            cap += step;
-            if(step < 4096) {
-                step *= 2;
-            }
-        }
-        return cap;
+        if(size <= BUFFER_INLINE) return BUFFER_INLINE;
+        if(size <= POOL_MAX) return pool_size(size);
+        int cap = _cap > POOL_MAX ? _cap : POOL_MAX;
+        while(cap < size) cap += cap >> 1;
+        return (cap + 4095) & ~4095;
     }
 public:
     Buffer() : ISlice() {};
@@ -173,21 +177,31 @@ public:
     Buffer(const char *s) : ISlice() {
         add(s);
     };
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
     ~Buffer() {
-        if(_ptr) _free(_ptr);
+        if(_ptr && _ptr != _inline) pool_free(_ptr, _cap);
         _ptr = NULL;
     }
 
     void resize(int capacity) {
         if(_ptr == NULL) {
             _cap = _get_cap(capacity);
-            _ptr = (char*)_malloc(_cap);
+            if(_cap == BUFFER_INLINE) _ptr = _inline;
+            else _ptr = (char*)pool_alloc(_cap);
             if(_ptr == NULL) THROW("No memory");
         } else if(capacity > _cap) {
-            _cap = _get_cap(capacity);
-            char *p = (char*)_realloc(_ptr, _cap);
+            int cap = _get_cap(capacity);
+            char *p;
+            if(_ptr == _inline) {
+                p = (char*)pool_alloc(cap);
+                if(p) memcpy(p, _ptr, _size);
+            } else {
+                p = (char*)pool_realloc(_ptr, _cap, cap, _size);
+            }
             if(!p) THROW("Realloc error");
             _ptr = p;
+            _cap = cap;
         }
     }
     void resize(int capacity, int size) {
@@ -212,12 +226,12 @@ public:
     void add(ISlice &s) {
         add(s.ptr(), s.size());
     }
-    void add_number(int n) {
-        resize(_size + 12);
+    void add_number(i64 n) {
+        resize(_size + 21);
         
-        char s[12];
+        char s[21];
         int d;
-        int i=11;
+        int i=20;
         bool negative = false;
         if(n == 0) {
             s[i--] = '0';
@@ -233,7 +247,7 @@ public:
         if(negative) {
             s[i--] = '-';
         }
-        add(&s[i + 1], 11 - i);
+        add(&s[i + 1], 20 - i);
     }
     void set(const char *buf, int size) {
         clear();
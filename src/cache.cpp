@@ -0,0 +1,82 @@
+#include <string_view>
+#include "cache.h"
+
+
+/*
+    Results of idempotent methods by method + request body.
+    LRU per shard, a shard is chosen by the hash, the size is limited by bytes.
+*/
+
+
+u64 ResultCache::hash(ISlice &method, ISlice &body) {
+    std::hash<std::string_view> h;
+    u64 m = h(std::string_view(method.ptr(), method.size()));
+    return h(std::string_view(body.ptr(), body.size())) ^ (m * 0x9e3779b97f4a7c15ULL);
+}
+
+bool ResultCache::_match(CacheEntry &e, ISlice &method, ISlice &body) {
+    if(e.key.size() != (size_t)(method.size() + 1 + body.size())) return false;
+    const char *k = e.key.data();
+    return memcmp(k, method.ptr(), method.size()) == 0 && memcmp(k + method.size() + 1, body.ptr(), body.size()) == 0;
+}
+
+void ResultCache::_erase(CacheShard &shard, std::list<CacheEntry>::iterator it) {
+    shard.bytes -= it->key.size() + it->result.size() + CACHE_ENTRY_OVERHEAD;
+    shard.map.erase(it->hash);
+    shard.lru.erase(it);
+}
+
+bool ResultCache::get(u64 hash, ISlice &method, ISlice &body, long now, Buffer &result) {
+    CacheShard &shard = _shards[hash % CACHE_SHARDS];
+    LOCK _l(shard.mutex);
+    auto found = shard.map.find(hash);
+    if(found == shard.map.end()) return false;
+    auto it = found->second;
+    if(it->expire <= now) {
+        shard.expired++;
+        _erase(shard, it);
+        return false;
+    }
+    if(!_match(*it, method, body)) return false;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it);
+    result.set(it->result.data(), it->result.size());
+    return true;
+}
+
+void ResultCache::put(u64 hash, ISlice &method, ISlice &body, ISlice &result, long expire) {
+    i64 size = method.size() + 1 + body.size() + result.size() + CACHE_ENTRY_OVERHEAD;
+    if(body.size() > CACHE_MAX_KEY || size > _shard_size / 4) return;
+
+    CacheShard &shard = _shards[hash % CACHE_SHARDS];
+    LOCK _l(shard.mutex);
+    auto found = shard.map.find(hash);
+    if(found != shard.map.end()) _erase(shard, found->second);
+
+    while(shard.lru.size() && shard.bytes + size > _shard_size) {
+        shard.evictions++;
+        _erase(shard, std::prev(shard.lru.end()));
+    }
+
+    shard.lru.emplace_front();
+    CacheEntry &e = shard.lru.front();
+    e.hash = hash;
+    e.expire = expire;
+    e.key.reserve(method.size() + 1 + body.size());
+    e.key.append(method.ptr(), method.size());
+    e.key.push_back('\0');
+    e.key.append(body.ptr(), body.size());
+    e.result.assign(result.ptr(), result.size());
+    shard.map[hash] = shard.lru.begin();
+    shard.bytes += size;
+}
+
+void ResultCache::get_stats(CacheStats &stats) {
+    for(int i=0;i<CACHE_SHARDS;i++) {
+        CacheShard &shard = _shards[i];
+        LOCK _l(shard.mutex);
+        stats.entries += shard.lru.size();
+        stats.bytes += shard.bytes;
+        stats.evictions += shard.evictions;
+        stats.expired += shard.expired;
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include "utils.h"
+#include "metrics.h"
+
+
+#define CACHE_SHARDS 16
+#define CACHE_MAX_KEY (64 << 10)  // bigger requests are not cached
+#define CACHE_ENTRY_OVERHEAD 96  // list and map nodes
+
+
+class CacheEntry {
+public:
+    u64 hash;
+    long expire;  // ms, loop time
+    std::string key;  // method \0 body
+    std::string result;
+};
+
+
+class alignas(CACHE_LINE) CacheShard {
+public:
+    std::mutex mutex;
+    std::list<CacheEntry> lru;  // recently used first
+    std::unordered_map<u64, std::list<CacheEntry>::iterator> map;
+    i64 bytes = 0;
+    u64 evictions = 0;  // dropped for space, under mutex
+    u64 expired = 0;
+};
+
+
+class CacheStats {
+public:
+    u64 entries = 0;
+    i64 bytes = 0;
+    u64 evictions = 0;
+    u64 expired = 0;
+};
+
+
+class ResultCache {
+private:
+    CacheShard _shards[CACHE_SHARDS];
+    i64 _shard_size;
+    bool _match(CacheEntry &e, ISlice &method, ISlice &body);
+    void _erase(CacheShard &shard, std::list<CacheEntry>::iterator it);
+public:
+    ResultCache(i64 size) : _shard_size(size / CACHE_SHARDS) {};
+    static u64 hash(ISlice &method, ISlice &body);
+    bool get(u64 hash, ISlice &method, ISlice &body, long now, Buffer &result);
+    void put(u64 hash, ISlice &method, ISlice &body, ISlice &result, long expire);
+    void get_stats(CacheStats &stats);
+};
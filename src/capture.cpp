@@ -0,0 +1,84 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "capture.h"
+
+
+/*
+    Append-only log of requests and results, one file per loop.
+    A file is written through a mapped window, records never cross a window.
+*/
+
+
+Capture::~Capture() {
+    if(_map) munmap(_map, CAPTURE_WINDOW);
+    if(_fd >= 0) {
+        if(ftruncate(_fd, _pos)) {}
+        ::close(_fd);
+    }
+}
+
+void Capture::_map_window(u64 offset) {
+    if(_map) munmap(_map, CAPTURE_WINDOW);
+    _map = NULL;
+    if(ftruncate(_fd, offset + CAPTURE_WINDOW)) THROW("Capture: ftruncate");
+    void *p = mmap(NULL, CAPTURE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset);
+    if(p == MAP_FAILED) THROW("Capture: mmap");
+    _map = (char*)p;
+    _window = offset;
+}
+
+void Capture::open(const char *path, u64 start) {
+    this->start = start;
+    _fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(_fd < 0) THROW("Capture: can't open file");
+    _map_window(0);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    CaptureHeader *header = (CaptureHeader*)_map;
+    memcpy(header->magic, CAPTURE_MAGIC, 8);
+    header->start = (u64)now.tv_sec * 1000000 + now.tv_usec - (get_time_us() - start);
+    _pos = sizeof(CaptureHeader);
+}
+
+void Capture::add(int type, ISlice &method, ISlice &id, ISlice &data, u64 now) {
+    if(!_map) return;
+    u32 stored = body ? data.size() : 0;
+    if(stored > CAPTURE_MAX_BODY) stored = CAPTURE_MAX_BODY;
+    u32 method_size = method.size() < 0xffff ? method.size() : 0xffff;
+    u32 id_size = id.size() < 256 ? id.size() : 256;
+    u32 size = (sizeof(CaptureRecord) + method_size + id_size + stored + 7) & ~7;
+
+    if(_pos + size > _window + CAPTURE_WINDOW) {
+        // mark the rest as padding and go to the next window
+        u64 left = _window + CAPTURE_WINDOW - _pos;
+        if(left >= sizeof(CaptureRecord)) {
+            CaptureRecord *pad = (CaptureRecord*)&_map[_pos - _window];
+            pad->size = left;
+            pad->type = CAPTURE_PADDING;
+        }
+        _map_window(_window + CAPTURE_WINDOW);
+        _pos = _window;
+    }
+
+    char *ptr = &_map[_pos - _window];
+    CaptureRecord *r = (CaptureRecord*)ptr;
+    r->size = size;
+    r->type = type;
+    r->method_size = method_size;
+    r->id_size = id_size;
+    r->body_size = data.size();
+    r->stored_size = stored;
+    r->reserved = 0;
+    r->time = now - start;
+    ptr += sizeof(CaptureRecord);
+    memcpy(ptr, method.ptr(), method_size);
+    ptr += method_size;
+    memcpy(ptr, id.ptr(), id_size);
+    ptr += id_size;
+    if(stored) memcpy(ptr, data.ptr(), stored);
+    _pos += size;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "utils.h"
+
+
+#define CAPTURE_WINDOW (64 << 20)  // mapped part of a file
+#define CAPTURE_MAX_BODY (1 << 20)  // longer bodies are cut
+#define CAPTURE_MAGIC "IJCAP01"
+
+#define CAPTURE_PADDING 0  // the rest of a window is empty
+#define CAPTURE_REQUEST 1
+#define CAPTURE_RESULT 2
+
+
+struct CaptureHeader {
+    char magic[8];
+    u64 start;  // unix time of the capture start, us
+};
+
+
+struct CaptureRecord {
+    u32 size;  // whole record, aligned to 8
+    u16 type;
+    u16 method_size;
+    u32 id_size;
+    u32 body_size;  // original size of a body
+    u32 stored_size;  // stored part of a body
+    u32 reserved;
+    u64 time;  // us from the capture start
+    // method, id, body
+};
+
+
+class Capture {
+private:
+    int _fd = -1;
+    char *_map = NULL;
+    u64 _window = 0;  // file offset of the mapped window
+    u64 _pos = 0;  // write position in the file
+    void _map_window(u64 offset);
+public:
+    bool body = false;  // store bodies
+    u64 start = 0;  // monotonic us
+
+    ~Capture();
+    void open(const char *path, u64 start);
+    void add(int type, ISlice &method, ISlice &id, ISlice &data, u64 now);
+};
@@ -1,6 +1,8 @@
 
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <uuid/uuid.h>
 #include "connect.h"
@@ -13,6 +15,7 @@ void Connect::unlink() {
 };
 
 void Connect::write_mode(bool active) {
+    if(detached) return;
     if(active) {
         if(_socket_status & 2) return;
         _socket_status |= 2;
@@ -38,26 +41,108 @@ int Connect::raw_send(const void *buf, uint size) {
     return ::send(this->fd, buf, size, 0);
 }
 
+int Connect::_send_shared() {
+    // send_buffer up to shared_at, the shared body, the rest of send_buffer
+    struct iovec iov[3];
+    int n = 0;
+    char *ptr = send_buffer.ptr();
+    if(send_offset < shared_at) iov[n++] = {ptr + send_offset, (size_t)(shared_at - send_offset)};
+    iov[n++] = {shared_body->ptr() + shared_sent, (size_t)(shared_body->size() - shared_sent)};
+    if(send_buffer.size() > shared_at) iov[n++] = {ptr + shared_at, (size_t)(send_buffer.size() - shared_at)};
+    int sent = writev(fd, iov, n);
+    if(sent <= 0) return sent;
+
+    int left = sent;
+    if(send_offset < shared_at) {
+        int head = shared_at - send_offset;
+        if(left < head) head = left;
+        send_offset += head;
+        left -= head;
+    }
+    int body = shared_body->size() - shared_sent;
+    if(left < body) body = left;
+    shared_sent += body;
+    left -= body;
+    if(shared_sent == shared_body->size()) {
+        shared_body.reset();
+        shared_sent = 0;
+        send_offset += left;
+    }
+    return sent;
+}
+
 void Connect::on_send() {
-    if(send_buffer.size()) {
-        int sent = this->raw_send(send_buffer.ptr(), send_buffer.size());
-        if(sent < 0) THROW("Not implemented: sent < 0");
-        send_buffer.remove_left(sent);
+    int left = send_buffer.size() - send_offset;
+    if(shared_body) left += shared_body->size() - shared_sent;
+    if(left > 0) {
+        bool shared = (bool)shared_body;
+        int sent;
+        if(shared) sent = _send_shared();  // moves offsets itself
+        else sent = this->raw_send(&send_buffer.ptr()[send_offset], left);
+        inc(loop->metrics.send_calls);
+        if(sent < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            THROW("send error");
+        }
+        inc(loop->metrics.bytes_sent, sent);
+        if(!shared) send_offset += sent;
     }
 
-    if(send_buffer.size() == 0) {
+    if(shared_body) return;
+    if(send_offset >= send_buffer.size()) {
+        // everything is sent, rewind without moving data
+        send_buffer.clear();
+        send_offset = 0;
+        if(trace) loop->trace_done(this);
         if(this->keep_alive) {
             this->write_mode(false);
+            if(server->idle_timeout) loop->set_timer(this, loop->now + server->idle_timeout);
         } else {
             this->close();
         }
+    } else if(send_offset > POOL_MAX && send_offset > send_buffer.size() / 2) {
+        // responses keep coming, compact when the sent part dominates
+        send_buffer.remove_left(send_offset);
+        send_offset = 0;
     }
 };
 
 
+bool Connect::recv_direct(char *&ptr, int &size) {
+    // the rest of a known-size body is read straight into body
+    if(http_step != HTTP_READ_BODY || buffer.size()) return false;
+    if(!(status == Status::net || (status == Status::worker_wait_result && noid))) return false;
+    int left = content_length - body.size();
+    if(left <= 0) return false;
+    if(body.get_capacity() == body.size()) {
+        // don't trust a big Content-Length before the data comes
+        int reserve = body.size() > DIRECT_RESERVE ? body.size() : DIRECT_RESERVE;
+        body.resize(left > reserve ? body.size() + reserve : content_length);
+    }
+    size = body.get_capacity() - body.size();
+    if(size > left) size = left;
+    ptr = &body.ptr()[body.size()];
+    return true;
+}
+
+void Connect::on_recv_direct(int size) {
+    body.resize(0, body.size() + size);
+    if(body.size() == content_length) body_completed();
+}
+
+void Connect::body_completed() {
+    try {
+        this->header_completed();
+    } catch (const error::InvalidData &e) {
+        if(server->log & 4) Log(4) << "Error: Invalid data/json, socket " << fd << " " << (void*)this;
+        this->send.status("400 Invalid data")->done(-32700);
+    }
+    http_step = HTTP_START;
+}
+
 void Connect::on_recv(char *buf, int size) {
     if(!(status == Status::net || (status == Status::worker_wait_result && noid))) {
-        if(server->log & 4) std::cout << ltime() << "connect " << (void*)this << ", warning: data is come, but connection is not ready\n";
+        if(server->log & 4) Log(4) << "connect " << (void*)this << ", warning: data is come, but connection is not ready";
         buffer.add(buf, size);
         return;
     }
@@ -80,15 +165,7 @@ void Connect::on_recv(char *buf, int size) {
             body.add(s);
             //buffer.add(data);
         }
-        if(body.size() == content_length) {
-            try {
-                this->header_completed();
-            } catch (const error::InvalidData &e) {
-                if(server->log & 4) std::cout << ltime() << "Error: Invalid data/json, socket " << fd << " " << (void*)this << std::endl;
-                this->send.status("400 Invalid data")->done(-32700);
-            }
-            http_step = HTTP_START;
-        }
+        if(body.size() == content_length) body_completed();
         if(data.empty()) return;
     }
 
@@ -105,6 +182,7 @@ void Connect::on_recv(char *buf, int size) {
                 int for_read = content_length;
                 if(for_read > data.size()) for_read = data.size();
                 Slice body_data = data.pop(for_read);
+                body.resize(content_length < DIRECT_RESERVE ? content_length : DIRECT_RESERVE);
                 body.set(body_data);
 
                 if(body.size() < content_length) {
@@ -130,14 +208,26 @@ void Connect::on_recv(char *buf, int size) {
             break;
         }
         if(http_step == HTTP_START) {
+            recv_us = loop->now_us;
+            task_us = result_us = 0;
+            trace = false;
             body.clear();
             id.clear();
             header_option.reset();
             info.reset();
-            json.reset();
+            envelope.reset();
             if(!worker_mode) name.clear();
             content_length = 0;
             priority = 0;
+            deadline = 0;
+            cache_ttl = -1;
+            cache_hash = 0;
+            async = false;
+            broadcast_need = 0;
+            peer_name.reset();
+            forwarded = NULL;
+            has_task = false;
+            has_limits = false;
             if(status != Status::worker_wait_result) {
                 if(worker_mode) THROW("Wrong status for worker");
                 fail_on_disconnect = false;
@@ -148,7 +238,7 @@ void Connect::on_recv(char *buf, int size) {
                 if(!noid) THROW("noid is false");
             }
             if(this->read_method(line) != 0) {
-                if(server->log & 2) std::cout << ltime() << "Wrong http header\n";
+                if(server->log & 2) Log(2) << "Wrong http header";
                 this->close();
                 return;
             }
@@ -207,12 +297,40 @@ void Connect::read_header(Slice &data) {
     } else if(data.starts_with("Priority: ")) {
         data.remove(10);
         priority = data.atoi();
+    } else if(data.starts_with("Timeout: ")) {
+        // ms
+        data.remove(9);
+        deadline = loop->now + data.atol();
+    } else if(data.starts_with("Deadline: ")) {
+        // unix time, ms
+        data.remove(10);
+        deadline = loop->now + data.atol() - get_time() / 1000;
+    } else if(data.starts_with("Broadcast: ")) {
+        // all, first or a number of results
+        data.remove(11);
+        if(data == "all") broadcast_need = -1;
+        else if(data == "first") broadcast_need = 1;
+        else {
+            broadcast_need = data.atoi();
+            if(broadcast_need < 1) throw error::InvalidData();
+        }
+    } else if(data.starts_with("Peer: ")) {
+        data.remove(6);
+        peer_name = data;
+    } else if(data.starts_with("Cache: ")) {
+        // ms, ttl of a result
+        data.remove(7);
+        cache_ttl = data.atoi();
     }
 }
 
 
 void Connect::header_completed() {
     this->keep_alive = http_version == 11;
+    if(server->draining && !worker_mode && !noid && path != "rpc/add" && path != "rpc/result") {
+        // clients reconnect to the new process, workers stay for queued clients
+        this->keep_alive = false;
+    }
 
     if(server->log & 32) {
         Buffer repr(250);
@@ -225,8 +343,7 @@ void Connect::header_completed() {
         for(int i=0;i<repr.size();i++) {
             if(repr.ptr()[i] < 32) repr.ptr()[i] = '.';
         }
-        repr.add("\n", 2);
-        std::cout << ltime() << this->path.as_string() << " " << this->body.size() << "b " << repr.ptr();
+        Log(32) << this->path << " " << this->body.size() << "b " << repr;
     }
     
     if(this->path == "echo") {
@@ -261,7 +378,7 @@ void Connect::header_completed() {
             return;
         };
 
-        loop->worker_result_noid(this);
+        if(client) loop->worker_result_noid(this);  // no client after worker timeout
         if(!header_option.empty() && header_option == "stop") {
             worker_mode = false;
             this->send.status("200 OK")->done(1);
@@ -269,7 +386,7 @@ void Connect::header_completed() {
             return;
         }
         //if(go_loop)  // TODO move worker
-        rpc_add();
+        rpc_add(envelope);
         return;
     }
 
@@ -282,7 +399,7 @@ void Connect::header_completed() {
         if(r == 0) {
             this->send.status("200 OK")->done(1);
         } else if(r == -2) {
-            if(server->log & 4) std::cout << ltime() << "499 Client is gone\n";
+            if(server->log & 4) Log(4) << "499 Client is gone";
             this->send.status("499 Closed")->done(-1);
         }
         status = Status::net;
@@ -291,21 +408,21 @@ void Connect::header_completed() {
 
     Slice method;
     Slice id(this->id);
-    json.load(this->body);
+    JsonEnvelope params;
     bool root_json = true;
 
     if(this->path == "rpc/call") {
-        Slice params;
-        while(json.scan()) {
-            if(json.key == "method") method = json.value;
-            else if(json.key == "id" && id.empty()) {
-                id = json.value;
-                this->id.set(id);
-            } else if(json.key == "params") params = json.value;
+        get_envelope();
+        if(envelope.invalid) throw error::InvalidData();
+        method = envelope.method;
+        if(id.empty() && !envelope.id.empty()) {
+            id = envelope.id;
+            this->id.set(id);
         }
-        if(!params.empty()) {
-            root_json = false;
-            json.load(params);
+        if(!envelope.params.empty()) root_json = false;
+        if(!deadline && !envelope.timeout.empty()) {
+            Slice timeout(envelope.timeout);
+            deadline = loop->now + timeout.atol();
         }
 
         if(!method.empty() && method.ptr()[0] == '/') method.remove(1);
@@ -317,34 +434,33 @@ void Connect::header_completed() {
         method = this->path;
     };
 
-    if(method == "rpc/worker") {
-        worker_mode = true;
-        rpc_add();
-        return;
-    } else if(method == "rpc/add") {
-        rpc_add();
+    if(method == "rpc/worker" || method == "rpc/add") {
+        if(method == "rpc/worker") worker_mode = true;
+        if(root_json) {
+            rpc_add(get_envelope());
+        } else {
+            params.load(envelope.params);
+            rpc_add(params);
+        }
         return;
     } else if(method == "rpc/result") {
         if(id.empty() && root_json) {
-            while(json.scan()) {
-                if(json.key == "id") {
-                    id = json.value;
-                    break;
-                }
-            }
+            get_envelope();
+            if(envelope.id.empty() && envelope.invalid) throw error::InvalidData();
+            id = envelope.id;
         }
         if(id.empty()) {
-            if(server->log & 2) std::cout << ltime() << "400 no id for /rpc/result\n";
+            if(server->log & 2) Log(2) << "400 no id for /rpc/result";
             this->send.status("400 No id")->done(-1);
         } else {
             int r = loop->worker_result(id, this);
             if(r == 0) {
                 this->send.status("200 OK")->done(1);
             } else if(r == -2) {
-                if(server->log & 4) std::cout << ltime() << "499 Client is gone\n";
+                if(server->log & 4) Log(4) << "499 Client is gone";
                 this->send.status("499 Closed")->done(-1);
             } else {
-                if(server->log & 2) std::cout << ltime() << "400 Wrong id for /rpc/result\n";
+                if(server->log & 2) Log(2) << "400 Wrong id for /rpc/result";
                 this->send.status("400 Wrong id")->done(-1);
             }
         }
@@ -353,38 +469,67 @@ void Connect::header_completed() {
     } else if(method == "rpc/details") {
         send_details();
         return;
+    } else if(method == "rpc/trace") {
+        Buffer res(4096);
+        render_trace(server, res);
+        Slice type("application/json");
+        send.status("200 OK")->header("Content-Type", type)->done(res);
+        return;
+    } else if(method == "rpc/metrics") {
+        Buffer res(4096);
+        render_metrics(server, res);
+        Slice type("text/plain; version=0.0.4");
+        send.status("200 OK")->header("Content-Type", type)->done(res);
+        return;
+    } else if(method == "rpc/fetch" || method.starts_with("rpc/fetch/")) {
+        // /rpc/fetch/<id> or Id header
+        if(method.size() > 10) {
+            method.remove(10);
+            this->id.set(method);
+        }
+        if(this->id.empty()) {
+            this->send.status("400 No id")->done(-1);
+            return;
+        }
+        loop->fetch_result(this);
+        return;
+    } else if(method.starts_with("rpc/peer/")) {
+        loop->peer_message(this, method, header_option == "error");
+        return;
     } else if(method == "/" || method == "rpc/help") {
         send_help();
         return;
     }
 
+    async = header_option == "async";
     loop->client_request(method, this);
 }
 
-void Connect::rpc_add() {
+void Connect::rpc_add(JsonEnvelope &args) {
     Slice name(this->name);
 
-    while(json.scan()) {
-        if(json.key == "name") {
-            json.decode_value(this->name);
-            name = this->name;
-        } else if(json.key == "info") {
-            info = json.value;
-        } else if(json.key == "option") {
-            if(json.value == "no_id") {
-                this->noid = true;
-                this->fail_on_disconnect = true;
-            } else if(json.value == "fail_on_disconnect") this->fail_on_disconnect = true;
-            else {
-                // TODO: Wrong option!!!
-            }
+    if(args.invalid) throw error::InvalidData();
+    if(!args.name.empty()) {
+        this->name.set(args.name);
+        json::unescape(this->name);
+        name = this->name;
+    }
+    if(!args.info.empty()) info = args.info;
+    if(!args.limits.empty()) read_limits(args.limits);
+    if(!args.option.empty()) {
+        if(args.option == "no_id") {
+            this->noid = true;
+            this->fail_on_disconnect = true;
+        } else if(args.option == "fail_on_disconnect") this->fail_on_disconnect = true;
+        else {
+            // TODO: Wrong option!!!
         }
     }
 
     if(name.empty()) {
         worker_mode = false;
         this->send.status("400 No name")->done(-32602);
-        if(server->log & 4) std::cout << ltime() << "No name for worker " << this << std::endl;
+        if(server->log & 4) Log(4) << "No name for worker " << this;
         return;
     };
 
@@ -396,6 +541,73 @@ void Connect::rpc_add() {
     loop->add_worker(name, this);
 }
 
+void Connect::restore_worker(int flags, ISlice &names) {
+    // a worker waiting for a task in the old process
+    http_version = 11;
+    keep_alive = true;
+    noid = flags & HANDOVER_NOID;
+    fail_on_disconnect = flags & HANDOVER_FAIL_ON_DISCONNECT;
+    worker_mode = flags & HANDOVER_WORKER_MODE;
+    name.set(names);
+}
+
+void Connect::release_job() {
+    QueueLine *ql = job_queue.exchange(NULL);
+    if(ql) ql->inflight--;
+    if(coalesce_leader) server->coalesce_done(this, NULL);  // no result for followers
+}
+
+void Connect::read_limits(ISlice data) {
+    // {"queue": 100, "bytes": 1000000, "inflight": 200, "policy": "drop_oldest", "weight": 3, "cache": 5000, "coalesce": true, "durable": true}
+    limits = server->limits;
+    Json json(data);
+    while(json.scan()) {
+        if(json.key == "queue") limits.queue = json.value.atoi();
+        else if(json.key == "bytes") limits.bytes = json.value.atol();
+        else if(json.key == "inflight") limits.inflight = json.value.atoi();
+        else if(json.key == "policy") limits.drop_oldest = json.value == "drop_oldest";
+        else if(json.key == "cache") limits.cache = json.value.atoi();
+        else if(json.key == "coalesce") limits.coalesce = json.value == "true";
+        else if(json.key == "durable") limits.durable = json.value == "true";
+        else if(json.key == "weight") {
+            weight = json.value.atoi();
+            if(weight < 1 || weight > MAX_WEIGHT) throw error::InvalidData();
+        }
+    }
+    has_limits = true;
+}
+
+long Connect::get_deadline() {
+    // the earliest of client deadline and server limit for waiting
+    long result = deadline;
+    if(server->client_timeout && (wait_queue || forwarded) && !detached) {
+        long limit = wait_since + server->client_timeout;
+        if(!result || limit < result) result = limit;
+    }
+    return result;
+}
+
+JsonEnvelope &Connect::get_envelope() {
+    if(!envelope.loaded) envelope.load(body);
+    return envelope;
+}
+
+Slice Connect::get_id() {
+    if(id.empty()) {
+        Slice value = get_envelope().id;
+        if(!value.empty()) id.set(value);
+        else gen_id();
+    }
+    return Slice(id);
+}
+
+Slice Connect::get_key() {
+    // a call without its id for the cache and coalescing: params of a json envelope or the body
+    JsonEnvelope &e = get_envelope();
+    if(!e.invalid && !e.params.empty()) return e.params;
+    return Slice(body);
+}
+
 void Connect::gen_id() {
     id.resize(36, 36);
     uuid_t uuid;
@@ -408,10 +620,17 @@ void Connect::send_details() {
     Buffer res(256);
     res.add("{\"_version\":\"");
     res.add(ijson_version);
-    res.add("\",\n");
-    LOCK _l(server->global_lock);
-
-    for(const auto &ql : server->_queue_list) {
+    res.add("\",\n\"_requests\":");
+    u64 requests = 0;
+    for(int i=0;i<server->threads;i++) requests += server->loops[i]->requests;
+    res.add_number(requests);
+    res.add(",\"_buffer_mallocs\":");
+    res.add_number(get_pool_mallocs());
+    res.add(",\n");
+    std::vector<QueueLine*> queues;
+    server->get_queues(queues);
+
+    for(const auto &ql : queues) {
         res.add("\"");
         res.add(ql->name);
         res.add("\":{\"last_worker\":");
@@ -427,6 +646,16 @@ void Connect::send_details() {
         res.add_number(worker_count);
         res.add(",\"clients\":");
         res.add_number(client_count);
+        res.add(",\"shed\":");
+        res.add_number(ql->shed);
+        res.add(",\"rejected\":");
+        res.add_number(ql->rejected);
+        res.add(",\"inflight\":");
+        res.add_number(ql->inflight);
+        res.add(",\"queued_bytes\":");
+        res.add_number(ql->queued_bytes);
+        res.add(",\"weight\":");
+        res.add_number(ql->weight);
 
         if(!ql->info.empty()) {
             res.add(",\"info\":\"");
@@ -444,9 +673,10 @@ void Connect::send_help() {
     Buffer res(256);
     res.add("ijson ");
     res.add(ijson_version);
-    res.add("\n\nrpc/add     {name, [option], [info]}\nrpc/result  {[id]}\nrpc/worker  {name, [info]}\nrpc/details\nrpc/help\n\n");
-    LOCK _l(server->global_lock);
-    for(const auto &ql : server->_queue_list) {
+    res.add("\n\nrpc/add     {name, [option], [info], [limits]}\nrpc/result  {[id]}\nrpc/worker  {name, [info]}\nrpc/details\nrpc/metrics\nrpc/trace\nrpc/help\n\n");
+    std::vector<QueueLine*> queues;
+    server->get_queues(queues);
+    for(const auto &ql : queues) {
         res.add(ql->name);
 
         for(int i=ql->name.size();i<20;i++) res.add(" ", 1);
@@ -488,6 +718,14 @@ HttpSender *HttpSender::header(const char *key, ISlice &value) {
     return this;
 };
 
+HttpSender *HttpSender::header(const char *key, i64 value) {
+    conn->send_buffer.add(key);
+    conn->send_buffer.add(": ");
+    conn->send_buffer.add_number(value);
+    conn->send_buffer.add("\r\n");
+    return this;
+};
+
 void HttpSender::done(ISlice &body) {
     if(conn->is_closed()) THROW("Trying to send to closed socket");
 
@@ -504,6 +742,24 @@ void HttpSender::done(ISlice &body) {
     else _autosend = true;
 };
 
+void HttpSender::done(std::shared_ptr<Buffer> &body) {
+    // the body isn't copied, unless the connection is sending another shared body
+    if(conn->shared_body || body->size() == 0) {
+        done(*body);
+        return;
+    }
+    if(conn->is_closed()) THROW("Trying to send to closed socket");
+
+    conn->send_buffer.add("Content-Length: ");
+    conn->send_buffer.add_number(body->size());
+    conn->send_buffer.add("\r\n\r\n");
+    conn->shared_body = body;
+    conn->shared_at = conn->send_buffer.size();
+    conn->shared_sent = 0;
+    if(_autosend) conn->write_mode(true);
+    else _autosend = true;
+};
+
 void HttpSender::done() {
     if(conn->is_closed()) THROW("Trying to send to closed socket");
 
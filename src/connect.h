@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <memory>
 #include "server.h"
 #include "utils.h"
 #include "json.h"
@@ -16,6 +17,8 @@ enum class Status {
 #define HTTP_READ_BODY 2
 #define HTTP_REQUEST_COMPLETED 3
 
+#define DIRECT_RESERVE (1 << 20)  // max body capacity reserved ahead of data
+
 
 class HttpSender {
 private:
@@ -26,7 +29,9 @@ public:
     void set_connect(Connect *n_conn) {this->conn = n_conn;};
     HttpSender *status(const char *status);
     HttpSender *header(const char *key, ISlice &value);
+    HttpSender *header(const char *key, i64 value);
     void done(ISlice &body);
+    void done(std::shared_ptr<Buffer> &body);
     void done(int error);
     void done();
     HttpSender *autosend(bool active=true) {
@@ -45,18 +50,62 @@ public:
     bool keep_alive;
     HttpSender send;
     Buffer send_buffer;
+    int send_offset = 0;  // sent part of send_buffer
+    std::shared_ptr<Buffer> shared_body;  // goes after send_buffer[shared_at], not copied per connection
+    int shared_at = 0;
+    int shared_sent = 0;
     Loop *loop;
     int nloop = 0;
     int need_loop = 0;
     bool go_loop = false;
     Server *server;
     std::mutex mutex;
+    Timer timer;
+    long active = 0;  // ms, last recv
+    long wait_since = 0;  // ms, start of waiting in a queue
+    QueueLine *wait_queue = NULL;  // queue of a waiting client
+    int wait_loop = 0;
+    long deadline = 0;  // ms, set by client, 0 - none
+    u64 request_us = 0;  // for metrics
+    u64 task_us = 0;
+    bool trace = false;  // sampled request
+    QueueLine *trace_queue = NULL;
+    u64 accept_us = 0;
+    u64 recv_us = 0;
+    u64 result_us = 0;
+    int wait_bytes = 0;  // body size accounted in wait_queue
+    Connect *wait_prev = NULL;  // ClientQueue links
+    Connect *wait_next = NULL;
+    int wait_level = 0;
+    std::atomic<QueueLine*> job_queue{NULL};  // accounted in inflight of the method
+    QueueLimits limits;  // from rpc/add
+    bool has_limits = false;
+    int weight = 0;  // from rpc/add, 0 - not set
+    int cache_ttl = -1;  // ms, from a Cache header of a result, -1 - not set
+    u64 cache_hash = 0;  // method + body of a client request, 0 - not calculated
+    bool coalesce_leader = false;  // the same calls wait for its result
+    Connect *followers = NULL;  // under server->coalesce_lock
+    Connect *follow_next = NULL;
+    bool detached = false;  // a job without a socket, durable or async
+    bool async = false;  // Option: async, the client gets a job id
+    int attempts = 0;  // of a job, deliveries to workers which are lost
+    long retry_until = 0;  // ms, of a job which can't be queued
+    bool fetch_wait = false;  // long-poll of /rpc/fetch
+    int broadcast_need = 0;  // Broadcast header: results for a reply, -1 - all workers, 0 - not a broadcast
+    Broadcast *broadcast = NULL;  // of a waiting client, or of a part sent to one worker
+    Peer *peer = NULL;  // of a job forwarded by another node
+    Buffer peer_id;  // id of the call on that node
+    Slice peer_name;  // Peer header of a node link
+    Peer *forwarded = NULL;  // the node which runs the call of a waiting client
+    bool has_task = false;  // an id worker got a task and hasn't sent a request since, not idle
+    std::vector<std::pair<std::string, Connect*>> jobs;  // detached jobs taken by an id worker, under mutex
 
     Connect(Server *server, int fd) {
         this->server = server;
         this->fd = fd;
         loop = server->loops[0];
         send.set_connect(this);
+        timer.owner = this;
     };
     ~Connect() {
         fd = 0;
@@ -75,8 +124,12 @@ public:
     void unlink();
 
     void on_recv(char *buf, int size);
+    bool recv_direct(char *&ptr, int &size);
+    void on_recv_direct(int size);
     void on_send();
     int raw_send(const void *buf, uint size);
+    int _send_shared();
+    inline bool is_idle() {return http_step == HTTP_START && !buffer.size() && !send_buffer.size() && !shared_body;}
 
 private:
     int http_step = HTTP_START;
@@ -85,6 +138,7 @@ private:
     Buffer buffer;
     Buffer path;
     Slice header_option;
+    void body_completed();
 public:
     Buffer name;
     Status status = Status::net;
@@ -95,16 +149,23 @@ public:
     bool worker_mode = false;
     int priority = 0;
     Connect *client = NULL;
-    Json json;
+    JsonEnvelope envelope;
     Slice info;
 
     int read_method(Slice &line);
     void read_header(Slice &data);
     void send_details();
     void send_help();
-    void rpc_add();
+    void rpc_add(JsonEnvelope &args);
     void rpc_worker();
+    void restore_worker(int flags, ISlice &names);
 
     void header_completed();
     void gen_id();
+    void release_job();
+    void read_limits(ISlice data);
+    long get_deadline();
+    JsonEnvelope &get_envelope();
+    Slice get_id();
+    Slice get_key();
 };
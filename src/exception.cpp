@@ -11,10 +11,10 @@
     };
 
     void Exception::print(const char *msg) const {
-        std::cout << ltime() << msg << " '" << _reason << "'";
-        if(_file) std::cout << ", file " << _file << ":" << _line << " " << _func << std::endl;
-        else std::cout << std::endl;
-        std::cout << _trace->ptr();
+        Log line(1);
+        line << msg << " '" << _reason << "'";
+        if(_file) line << ", file " << _file << ":" << _line << " " << _func;
+        line << "\n" << _trace->ptr();
     }
 
     Exception::~Exception() {
@@ -23,9 +23,9 @@
 #else
     Exception::Exception(const char *reason, const char *file, int line, const char *func) : _reason(reason), _file(file), _line(line), _func(func) {};
     void Exception::print(const char *msg) const {
-        std::cout << ltime() << msg << " '" << _reason << "'";
-        if(_file) std::cout << ", file " << _file << ":" << _line << " " << _func << std::endl;
-        else std::cout << std::endl;
+        Log line(1);
+        line << msg << " '" << _reason << "'";
+        if(_file) line << ", file " << _file << ":" << _line << " " << _func;
     }
 #endif
 
@@ -0,0 +1,92 @@
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handover.h"
+
+
+/*
+    Sockets go from an old process to a new one over a unix socket (SCM_RIGHTS),
+    one message per socket: a type, data and the descriptor.
+*/
+
+
+static bool set_path(struct sockaddr_un &addr, const char *path) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+int handover_connect(const char *path) {
+    // -1 if there is no old process
+    struct sockaddr_un addr;
+    if(!set_path(addr, path)) THROW("handover path is too long");
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(sock < 0) THROW("handover socket");
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int handover_listen(const char *path) {
+    struct sockaddr_un addr;
+    if(!set_path(addr, path)) THROW("handover path is too long");
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(sock < 0) THROW("handover socket");
+    unlink(path);  // of the old process
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) THROW("handover bind");
+    if(listen(sock, 1) < 0) THROW("handover listen");
+    return sock;
+}
+
+bool handover_send(int sock, char type, ISlice &data, int fd) {
+    if(data.size() + 1 > HANDOVER_MAX) return false;
+    struct iovec iov[2] = {{&type, 1}, {data.ptr(), (size_t)data.size()}};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = data.size() ? 2 : 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == data.size() + 1;
+}
+
+int handover_recv(int sock, char &type, Buffer &data) {
+    // a descriptor, -1 without it; type is 0 when the old process is gone
+    type = 0;
+    data.resize(HANDOVER_MAX, 0);
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov[2] = {{&type, 1}, {data.ptr(), (size_t)HANDOVER_MAX}};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if(size <= 0) {
+        type = 0;
+        return -1;
+    }
+    data.resize(0, size - 1);
+    int fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "utils.h"
+
+
+#define HANDOVER_DRAIN 60  // sec, the old process exits after it even with open connections
+#define HANDOVER_MAX 65536  // message size
+
+#define HANDOVER_LISTEN 'L'  // the listening socket
+#define HANDOVER_WORKER 'W'  // a waiting worker: flags, names
+
+#define HANDOVER_NOID 1
+#define HANDOVER_FAIL_ON_DISCONNECT 2
+#define HANDOVER_WORKER_MODE 4
+
+
+int handover_connect(const char *path);
+int handover_listen(const char *path);
+bool handover_send(int sock, char type, ISlice &data, int fd);
+int handover_recv(int sock, char &type, Buffer &data);
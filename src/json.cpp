@@ -1,6 +1,11 @@
 
 #include "json.h"
 
+#if defined(__SSE2__) && !defined(NO_SIMD)
+    #include <emmintrin.h>
+    #define JSON_SIMD
+#endif
+
 
 void json::unescape(Buffer &s, int start) {
     char *p = s.ptr();
@@ -19,6 +24,147 @@ void json::unescape(Buffer &s, int start) {
 }
 
 
+#ifdef JSON_SIMD
+
+int json::find_quote(const char *ptr, int index, int size) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    while(index + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&ptr[index]);
+        u32 m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)));
+        if(!m) {
+            index += 16;
+            continue;
+        }
+        index += __builtin_ctz(m);
+        if(ptr[index] == '"') return index;
+        index += 2;  // escaped char
+    }
+    for(;index < size;index++) {
+        if(ptr[index] == '\\') index++;
+        else if(ptr[index] == '"') return index;
+    }
+    return -1;
+}
+
+
+struct Stage1 {
+    // bit masks for a 64-byte block
+    u64 quote;
+    u64 slash;
+    u64 open;
+    u64 close;
+
+    inline void load(const char *p) {
+        const __m128i q = _mm_set1_epi8('"');
+        const __m128i s = _mm_set1_epi8('\\');
+        const __m128i lower = _mm_set1_epi8(0x20);
+        const __m128i o = _mm_set1_epi8('{');  // '[' | 0x20
+        const __m128i c = _mm_set1_epi8('}');  // ']' | 0x20
+        quote = slash = open = close = 0;
+        for(int i=0;i<4;i++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&p[i * 16]);
+            __m128i l = _mm_or_si128(v, lower);
+            quote |= (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << (i * 16);
+            slash |= (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, s)) << (i * 16);
+            open |= (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(l, o)) << (i * 16);
+            close |= (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(l, c)) << (i * 16);
+        }
+    }
+};
+
+
+static inline u64 find_escaped(u64 slash, u64 &prev_odd) {
+    // chars preceded by an odd-length run of backslashes
+    const u64 even_bits = 0x5555555555555555ULL;
+    const u64 odd_bits = ~even_bits;
+    u64 start_edges = slash & ~(slash << 1);
+    u64 even_start_mask = even_bits ^ prev_odd;
+    u64 even_starts = start_edges & even_start_mask;
+    u64 odd_starts = start_edges & ~even_start_mask;
+    u64 even_carries = slash + even_starts;
+    unsigned long long odd_carries;
+    bool ends_odd = __builtin_uaddll_overflow(slash, odd_starts, &odd_carries);
+    odd_carries |= prev_odd;
+    prev_odd = ends_odd ? 1 : 0;
+    u64 even_carry_ends = even_carries & ~slash;
+    u64 odd_carry_ends = odd_carries & ~slash;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+
+static inline u64 prefix_xor(u64 x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+
+int json::find_close(const char *ptr, int index, int size) {
+    Stage1 b;
+    char tail[64];
+    u64 prev_odd = 0;
+    u64 prev_in_string = 0;
+    int depth = 0;
+    for(int pos=index;pos < size;pos += 64) {
+        if(size - pos >= 64) b.load(&ptr[pos]);
+        else {
+            memset(tail, ' ', 64);
+            memcpy(tail, &ptr[pos], size - pos);
+            b.load(tail);
+        }
+
+        u64 quote = b.quote & ~find_escaped(b.slash, prev_odd);
+        u64 in_string = prefix_xor(quote) ^ prev_in_string;
+        prev_in_string = (u64)((i64)in_string >> 63);
+
+        u64 open = b.open & ~in_string;
+        u64 structural = (open | b.close) & ~in_string;
+        while(structural) {
+            int bit = __builtin_ctzll(structural);
+            if(open & (1ULL << bit)) depth++;
+            else if(--depth == 0) return pos + bit + 1;
+            structural &= structural - 1;
+        }
+    }
+    return -1;
+}
+
+#else
+
+int json::find_quote(const char *ptr, int index, int size) {
+    for(;index < size;index++) {
+        if(ptr[index] == '\\') index++;
+        else if(ptr[index] == '"') return index;
+    }
+    return -1;
+}
+
+
+int json::find_close(const char *ptr, int index, int size) {
+    int lvl = 0;
+    for(;index < size;index++) {
+        char a = ptr[index];
+        if(a == '{' || a == '[') {
+            lvl++;
+        } else if(a == '}' || a == ']') {
+            lvl--;
+            if(lvl == 0) return index + 1;
+        } else if(a == '"') {
+            index = find_quote(ptr, index + 1, size);
+            if(index < 0) return -1;
+        }
+    }
+    return -1;
+}
+
+#endif
+
+
 bool Json::scan() {
     if(_data.empty()) return false;
     strip();
@@ -63,14 +209,10 @@ void Json::strip() {
 Slice Json::read_string() {
     if(next() != '"') throw error::InvalidData();
     int start = index;
-    const char *ptr = _data.ptr();
-    for(;index < _data.size();index++) {
-        if(ptr[index] == '"' && ptr[index-1] != '\\') {
-            index++;
-            return Slice(&ptr[start], index - start - 1);
-        }
-    }
-    throw error::InvalidData();
+    int end = json::find_quote(_data.ptr(), index, _data.size());
+    if(end < 0) throw error::InvalidData();
+    index = end + 1;
+    return Slice(&_data.ptr()[start], end - start);
 }
 
 
@@ -94,21 +236,11 @@ Slice Json::read_value() {
 
 
 Slice Json::read_object() {
-    int lvl = 0;
     int start = index;
-    while(true) {
-        char a = next();
-        if(a == '{' || a == '[') {
-            lvl++;
-        } else if(a == '}' || a == ']') {
-            lvl--;
-            if(lvl==0) return Slice(&_data.ptr()[start], index - start);
-        } else if(a == '"') {
-            index--;
-            read_string();
-            continue;
-        }
-    }
+    int end = json::find_close(_data.ptr(), index, _data.size());
+    if(end < 0) throw error::InvalidData();
+    index = end;
+    return Slice(&_data.ptr()[start], end - start);
 }
 
 
@@ -116,3 +248,26 @@ void Json::decode_value(Buffer &dest) {
     dest.set(value);
     json::unescape(dest);
 }
+
+
+void JsonEnvelope::load(ISlice data) {
+    reset();
+    loaded = true;
+    Json json(data);
+    try {
+        while(json.scan()) {
+            if(json.key == "id") {
+                if(!id.valid()) id = json.value;
+            } else if(json.key == "method") method = json.value;
+            else if(json.key == "params") params = json.value;
+            else if(json.key == "name") name = json.value;
+            else if(json.key == "option") option = json.value;
+            else if(json.key == "info") info = json.value;
+            else if(json.key == "timeout") timeout = json.value;
+            else if(json.key == "limits") limits = json.value;
+        }
+    } catch (const error::InvalidData &e) {
+        // keep members found before the error
+        invalid = true;
+    }
+}
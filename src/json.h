@@ -6,6 +6,8 @@
 
 namespace json {
     void unescape(Buffer &s, int start=0);
+    int find_quote(const char *ptr, int index, int size);  // index of the closing quote, -1 if none
+    int find_close(const char *ptr, int index, int size);  // index after the matching bracket, -1 if none
 };
 
 
@@ -42,3 +44,34 @@ private:
     Slice read_value();
     Slice read_object();
 };
+
+
+class JsonEnvelope {
+public:
+    // top-level members, slices point into the indexed data
+    Slice id;
+    Slice method;
+    Slice params;
+    Slice name;
+    Slice option;
+    Slice info;
+    Slice timeout;
+    Slice limits;
+    bool loaded;
+    bool invalid;
+
+    JsonEnvelope() {reset();};
+    void reset() {
+        id.reset();
+        method.reset();
+        params.reset();
+        name.reset();
+        option.reset();
+        info.reset();
+        timeout.reset();
+        limits.reset();
+        loaded = false;
+        invalid = false;
+    };
+    void load(ISlice data);
+};
@@ -0,0 +1,199 @@
+
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include "utils.h"
+#include "log.h"
+
+
+/*
+    Threads put lines into own rings, a writer thread drains them to stdout,
+    so a hot path only copies a line and never waits for the output.
+*/
+
+
+#define LOG_SKIP 0xFFFFFFFF
+
+
+struct LogHeader {
+    u32 size;  // message size, LOG_SKIP - continues from the start of the ring
+    u16 level;
+    u16 thread;
+    i64 time;
+};
+
+
+static std::mutex rings_lock;
+static std::vector<LogRing*> rings;
+static std::mutex write_lock;
+static bool log_json = false;
+static std::atomic<bool> log_running{false};
+
+static thread_local LogRing *local_ring = NULL;
+static thread_local Buffer local_line(256);
+
+
+LogRing::LogRing(int thread) : thread(thread) {
+    data = (char*)malloc(LOG_RING);
+    if(!data) THROW("No memory");
+}
+
+void LogRing::push(int level, long time, const char *msg, int size) {
+    // a line is dropped if the writer is behind
+    u32 need = (sizeof(LogHeader) + size + 7) & ~7;
+    u64 h = head.load(std::memory_order_relaxed);
+    u64 t = tail.load(std::memory_order_acquire);
+    u32 pos = h % LOG_RING;
+    u32 to_end = LOG_RING - pos;
+    u32 total = need;
+    if(to_end < need) total += to_end;  // wrap
+    if(h + total - t > LOG_RING) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if(to_end < need) {
+        if(to_end >= sizeof(LogHeader)) ((LogHeader*)&data[pos])->size = LOG_SKIP;
+        h += to_end;
+        pos = 0;
+    }
+    LogHeader *header = (LogHeader*)&data[pos];
+    header->size = size;
+    header->level = level;
+    header->thread = thread;
+    header->time = time;
+    memcpy(&data[pos + sizeof(LogHeader)], msg, size);
+    head.store(h + need, std::memory_order_release);
+}
+
+
+Log::Log(int level) : _level(level), _line(local_line) {
+    _line.clear();
+}
+
+Log::~Log() {
+    if(!local_ring) {
+        LOCK _l(rings_lock);
+        local_ring = new LogRing(rings.size());
+        rings.push_back(local_ring);
+    }
+    int size = _line.size();
+    while(size && _line.ptr()[size - 1] == '\n') size--;
+    if(size > LOG_MAX_LINE) size = LOG_MAX_LINE;
+    local_ring->push(_level, time(NULL), _line.ptr(), size);
+}
+
+Log &Log::operator<<(const void *p) {
+    char s[24];
+    int size = snprintf(s, sizeof(s), "%p", p);
+    _line.add(s, size);
+    return *this;
+}
+
+
+static long cached_sec = -1;
+static char cached_time[24];
+
+static void format_time(long sec) {
+    // localtime is called once per second
+    if(sec == cached_sec) return;
+    cached_sec = sec;
+    time_t t = sec;
+    struct tm now;
+    localtime_r(&t, &now);
+    strftime(cached_time, sizeof(cached_time), "%Y-%m-%d %H:%M:%S", &now);
+}
+
+static void add_json_string(Buffer &out, const char *s, int size) {
+    out.add("\"", 1);
+    for(int i=0;i<size;i++) {
+        unsigned char c = s[i];
+        if(c == '"' || c == '\\') {
+            out.add("\\", 1);
+            out.add(&s[i], 1);
+        } else if(c == '\n') out.add("\\n", 2);
+        else if(c == '\t') out.add("\\t", 2);
+        else if(c < 0x20) out.add("?", 1);
+        else out.add(&s[i], 1);
+    }
+    out.add("\"", 1);
+}
+
+static void write_line(Buffer &out, LogHeader *header, const char *msg) {
+    format_time(header->time);
+    if(log_json) {
+        out.add("{\"time\":\"");
+        out.add(cached_time);
+        out.add("\",\"level\":");
+        out.add_number(header->level);
+        out.add(",\"thread\":");
+        out.add_number(header->thread);
+        out.add(",\"msg\":");
+        add_json_string(out, msg, header->size);
+        out.add("}\n");
+    } else {
+        out.add(cached_time);
+        out.add(" ", 1);
+        out.add(msg, header->size);
+        out.add("\n", 1);
+    }
+}
+
+static bool drain() {
+    LOCK _l(write_lock);
+    std::vector<LogRing*> list;
+    {
+        LOCK _r(rings_lock);
+        list = rings;
+    }
+
+    Buffer out(65536);
+    for(LogRing *ring : list) {
+        u64 t = ring->tail.load(std::memory_order_relaxed);
+        u64 h = ring->head.load(std::memory_order_acquire);
+        while(t < h) {
+            u32 pos = t % LOG_RING;
+            u32 to_end = LOG_RING - pos;
+            LogHeader *header = (LogHeader*)&ring->data[pos];
+            if(to_end < sizeof(LogHeader) || header->size == LOG_SKIP) {
+                t += to_end;
+                continue;
+            }
+            write_line(out, header, &ring->data[pos + sizeof(LogHeader)]);
+            t += (sizeof(LogHeader) + header->size + 7) & ~7;
+        }
+        ring->tail.store(t, std::memory_order_release);
+
+        u64 dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if(dropped) {
+            Buffer msg(64);
+            msg.add("log: ");
+            msg.add_number(dropped);
+            msg.add(" lines are dropped");
+            LogHeader header = {(u32)msg.size(), 1, (u16)ring->thread, time(NULL)};
+            write_line(out, &header, msg.ptr());
+        }
+    }
+    if(!out.size()) return false;
+    fwrite(out.ptr(), 1, out.size(), stdout);
+    fflush(stdout);
+    return true;
+}
+
+static void writer() {
+    while(true) {
+        if(!drain()) usleep(5000);
+    }
+}
+
+void log_start(bool json) {
+    log_json = json;
+    if(log_running.exchange(true)) return;
+    std::thread(writer).detach();
+}
+
+void log_flush() {
+    drain();
+}
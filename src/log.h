@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include "buffer.h"
+
+
+#define LOG_RING (1 << 18)  // bytes per thread
+#define LOG_MAX_LINE 4096
+
+
+class LogRing {
+public:
+    // single producer (own thread), single consumer (writer thread)
+    char *data;
+    std::atomic<u64> head{0};  // written by the producer
+    std::atomic<u64> tail{0};  // read by the writer
+    std::atomic<u64> dropped{0};
+    int thread;
+
+    LogRing(int thread);
+    void push(int level, long time, const char *msg, int size);
+};
+
+
+class Log {
+private:
+    int _level;
+    Buffer &_line;
+public:
+    Log(int level);
+    ~Log();
+
+    Log &operator<<(const char *s) {_line.add(s); return *this;}
+    Log &operator<<(ISlice &s) {_line.add(s.ptr(), s.size()); return *this;}
+    Log &operator<<(const std::string &s) {_line.add(s.data(), s.size()); return *this;}
+    Log &operator<<(const void *p);
+    template<typename T> typename std::enable_if<std::is_integral<T>::value, Log&>::type operator<<(T n) {
+        _line.add_number((i64)n);
+        return *this;
+    }
+};
+
+
+void log_start(bool json);
+void log_flush();
@@ -1,5 +1,6 @@
 
 #include <iostream>
+#include <signal.h>
 #include "server.h"
 
 
@@ -7,16 +8,42 @@ const char *help_info = "\n\
     --host [ip][:port], default 127.0.0.1:8001\n\
     --filter 127.0.0.1/32\n\
     --log <option>\n\
+    --log-format text|json, json lines\n\
     --jsonrpc2\n\
     --threads <number>\n\
+    --cpus <list>, pin loops to cpus: 0-3,8-11, a connection goes to the loop on its incoming cpu\n\
+    --numa, loops use memory of their node, without --cpus loops are spread over nodes\n\
+    --timeout <sec>, client waiting for a worker gets 504\n\
+    --worker-timeout <sec>, waiting worker gets 204\n\
+    --idle-timeout <sec>, close idle keep-alive connections\n\
+    --max-queue <number>, waiting clients per method\n\
+    --max-queue-bytes <number>, bodies of waiting clients per method\n\
+    --max-inflight <number>, waiting and processing clients per method\n\
+    --queue-policy reject|drop_oldest, for a full queue\n\
+    --weight <name>=<number>, share of shared workers, name can be a prefix: tenant/*=3\n\
+    --trace <number>, trace 1 of N client requests for /rpc/trace\n\
+    --capture <path>, log requests and results to <path>.<loop>\n\
+    --capture-body, store bodies in the capture\n\
+    --cache <MB>, memory for results of methods with a cache ttl\n\
+    --results <MB>, memory for results of async calls, default 64\n\
+    --results-ttl <sec>, results of async calls are kept for, default 300\n\
+    --wal <dir>, write-ahead log of durable jobs\n\
+    --durable <name>, calls of the method are durable jobs, name can be a prefix: jobs/*\n\
+    --wal-sync <ms>, interval of group commit, default 0 - every loop iteration\n\
+    --peer <ip:port>, another node of a cluster, calls without an idle worker go to nodes with one\n\
+    --node-name <ip:port>, this node as other nodes list it in --peer, default is --host\n\
+    --handover <path>, unix socket of a restart: a new process takes the port and waiting workers, the old one drains\n\
 \n\
     --help\n\
     --version\n\
 \n\
-    /rpc/add     {name, [option], [info]}\n\
+    /rpc/add     {name, [option], [info], [limits]}\n\
     /rpc/result  {[id]}\n\
+    /rpc/fetch/<id>\n\
     /rpc/worker  {name, [info]}\n\
     /rpc/details\n\
+    /rpc/metrics\n\
+    /rpc/trace\n\
     /rpc/help\n\
 \n\
     --log\n\
@@ -32,10 +59,21 @@ const char *help_info = "\n\
 ";
 
 
+// linked in -fprofile-generate builds only (make pgo)
+extern "C" void __gcov_dump(void) __attribute__((weak));
+
+void on_profile_stop(int) {
+    // a profile is written by exit handlers, ijson is stopped by a signal
+    __gcov_dump();
+    _exit(0);
+}
+
+
 int main(int argc, char** argv) {
     #ifdef DEBUG
         catch_fatal();
     #endif
+    if(__gcov_dump) signal(SIGTERM, on_profile_stop);
 
     Server server;
     server.log = 15;
@@ -86,6 +124,168 @@ int main(int argc, char** argv) {
                 std::cout << "Wrong log option\n";
                 return 1;
             }
+        } else if(s == "--log-format") {
+            if(next == "text") server.log_json = false;
+            else if(next == "json") server.log_json = true;
+            else {
+                std::cout << "Wrong log format\n";
+                return 1;
+            }
+            i++;
+        } else if(s == "--timeout" || s == "--worker-timeout" || s == "--idle-timeout") {
+            int value = -1;
+            if(next.valid()) {
+                try {
+                    value = next.atoi();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(value < 0) {
+                std::cout << "Wrong timeout option\n";
+                return 1;
+            }
+            if(s == "--timeout") server.client_timeout = value * 1000;
+            else if(s == "--worker-timeout") server.worker_timeout = value * 1000;
+            else server.idle_timeout = value * 1000;
+        } else if(s == "--max-queue" || s == "--max-queue-bytes" || s == "--max-inflight") {
+            i64 value = -1;
+            if(next.valid()) {
+                try {
+                    value = next.atol();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(value < 0) {
+                std::cout << "Wrong limit option\n";
+                return 1;
+            }
+            if(s == "--max-queue") server.limits.queue = value;
+            else if(s == "--max-queue-bytes") server.limits.bytes = value;
+            else server.limits.inflight = value;
+        } else if(s == "--queue-policy") {
+            if(next == "reject") server.limits.drop_oldest = false;
+            else if(next == "drop_oldest") server.limits.drop_oldest = true;
+            else {
+                std::cout << "Wrong queue policy\n";
+                return 1;
+            }
+            i++;
+        } else if(s == "--capture") {
+            if(!next.valid()) {
+                std::cout << "Wrong capture option\n";
+                return 1;
+            }
+            server.capture_path = argv[i + 1];
+            i++;
+        } else if(s == "--capture-body") {
+            server.capture_body = true;
+        } else if(s == "--cache") {
+            int size = -1;
+            if(next.valid()) {
+                try {
+                    size = next.atoi();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(size < 1) {
+                std::cout << "Wrong cache option\n";
+                return 1;
+            }
+            server.cache_size = (i64)size << 20;
+        } else if(s == "--results" || s == "--results-ttl") {
+            int value = -1;
+            if(next.valid()) {
+                try {
+                    value = next.atoi();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(value < 1) {
+                std::cout << "Wrong results option\n";
+                return 1;
+            }
+            if(s == "--results") server.results_size = (i64)value << 20;
+            else server.results_ttl = value * 1000;
+        } else if(s == "--peer") {
+            if(!next.valid() || !strchr(argv[i + 1], ':')) {
+                std::cout << "Wrong peer option\n";
+                return 1;
+            }
+            server.peer_names.push_back(next.as_string());
+            i++;
+        } else if(s == "--node-name") {
+            if(!next.valid() || !strchr(argv[i + 1], ':')) {
+                std::cout << "Wrong node-name option\n";
+                return 1;
+            }
+            server.node_name = next.as_string();
+            i++;
+        } else if(s == "--handover") {
+            if(!next.valid()) {
+                std::cout << "Wrong handover option\n";
+                return 1;
+            }
+            server.handover_path = argv[i + 1];
+            i++;
+        } else if(s == "--wal") {
+            if(!next.valid()) {
+                std::cout << "Wrong wal option\n";
+                return 1;
+            }
+            server.wal_dir = argv[i + 1];
+            i++;
+        } else if(s == "--wal-sync") {
+            server.wal_sync = -1;
+            if(next.valid()) {
+                try {
+                    server.wal_sync = next.atoi();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(server.wal_sync < 0) {
+                std::cout << "Wrong wal-sync option\n";
+                return 1;
+            }
+        } else if(s == "--durable") {
+            Slice name;
+            if(next.valid()) {
+                name = next;
+                if(name.size() && name.ptr()[0] == '/') name.remove(1);
+                i++;
+            }
+            if(name.empty()) {
+                std::cout << "Wrong durable option\n";
+                return 1;
+            }
+            server.durable.push_back(name.as_string());
+        } else if(s == "--trace") {
+            server.trace_rate = -1;
+            if(next.valid()) {
+                try {
+                    server.trace_rate = next.atoi();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(server.trace_rate < 0) {
+                std::cout << "Wrong trace option\n";
+                return 1;
+            }
+        } else if(s == "--weight") {
+            int weight = -1;
+            Slice name;
+            if(next.valid()) {
+                name = next.split_left('=');
+                if(name.size() && name.ptr()[0] == '/') name.remove(1);
+                try {
+                    weight = next.atoi();
+                } catch(const Exception &e) {}
+                i++;
+            }
+            if(name.empty() || weight < 1 || weight > MAX_WEIGHT) {
+                std::cout << "Wrong weight option\n";
+                return 1;
+            }
+            server.weights.push_back({name.as_string(), weight});
         } else if(s == "--help") {
             std::cout << "ijson " << ijson_version << std::endl;
             std::cout << help_info;
@@ -95,6 +295,14 @@ int main(int argc, char** argv) {
         } else if(s == "--version") {
             std::cout << ijson_version << std::endl;
             return 0;
+        } else if(s == "--cpus") {
+            if(!next.valid() || !parse_cpu_list(argv[i + 1], server.cpus)) {
+                std::cout << "Wrong cpus option\n";
+                return 1;
+            }
+            i++;
+        } else if(s == "--numa") {
+            server.numa = true;
         } else if(s == "--threads") {
             server.threads = -1;
             if(next.valid()) {
@@ -113,6 +321,12 @@ int main(int argc, char** argv) {
         }
     }
 
+    if(server.handover_path && server.wal_dir) {
+        // both processes would own the log
+        std::cout << "--handover can't be used with --wal\n";
+        return 1;
+    }
+
     if(server.host.empty()) {
         #ifdef DOCKER
             server.host.set("0.0.0.0");
@@ -121,12 +335,22 @@ int main(int argc, char** argv) {
         #endif
     }
 
+    if(server.peer_names.size() && server.node_name.empty()) {
+        // nodes build the same ring only if they name each node the same way
+        if(server.host == "0.0.0.0") {
+            std::cout << "--peer needs --node-name or an ip in --host\n";
+            return 1;
+        }
+        server.node_name = server.host.as_string() + ":" + std::to_string(server.port);
+    }
+
     try {
         server.start();
     } catch (const Exception &e) {
         if(server.log & 1) e.print("Exception in server.start");
     } catch (const std::exception &e) {
-        if(server.log & 1) std::cout << ltime() << "Fatal exception: " << e.what() << std::endl;
+        if(server.log & 1) Log(1) << "Fatal exception: " << e.what();
     }
+    log_flush();
     return 1;
 }
@@ -1,5 +1,7 @@
 
 #include <iostream>
+#include <atomic>
+#include <string.h>
 #include "memory.h"
 
 
@@ -29,3 +31,87 @@
         _free(p);
     }
 #endif
+
+
+class PoolClass {
+public:
+    void *head;
+    u32 count;
+};
+
+thread_local PoolClass pool[POOL_MAX_BITS - POOL_MIN_BITS + 1];
+thread_local int pool_state = 0;  // 0 - new, 1 - lists are freed at exit, 2 - the thread is exiting
+std::atomic<u64> pool_mallocs(0);
+
+
+class PoolGuard {
+public:
+    void touch() {};
+    ~PoolGuard() {
+        // the thread exits, blocks of its lists go back to malloc, later frees bypass the pool
+        pool_state = 2;
+        for(PoolClass &c : pool) {
+            while(c.head) {
+                void *ptr = c.head;
+                c.head = *(void**)ptr;
+                _free(ptr);
+            }
+            c.count = 0;
+        }
+    }
+};
+
+thread_local PoolGuard pool_guard;
+
+
+u64 get_pool_mallocs() {
+    return pool_mallocs.load(std::memory_order_relaxed);
+}
+
+u32 pool_size(u32 size) {
+    if(size <= POOL_MIN) return POOL_MIN;
+    return 1 << (32 - __builtin_clz(size - 1));
+}
+
+void *pool_alloc(u32 size) {
+    if(size <= POOL_MAX) {
+        PoolClass &c = pool[31 - __builtin_clz(size) - POOL_MIN_BITS];
+        if(c.head) {
+            void *ptr = c.head;
+            c.head = *(void**)ptr;
+            c.count--;
+            return ptr;
+        }
+    }
+    pool_mallocs.fetch_add(1, std::memory_order_relaxed);
+    return _malloc(size);
+}
+
+void *pool_realloc(void *ptr, u32 size, u32 new_size, u32 used) {
+    if(size > POOL_MAX && new_size > POOL_MAX) {
+        pool_mallocs.fetch_add(1, std::memory_order_relaxed);
+        return _realloc(ptr, new_size);
+    }
+    void *p = pool_alloc(new_size);
+    if(!p) return NULL;
+    memcpy(p, ptr, used);
+    pool_free(ptr, size);
+    return p;
+}
+
+void pool_free(void *ptr, u32 size) {
+    if(size <= POOL_MAX) {
+        PoolClass &c = pool[31 - __builtin_clz(size) - POOL_MIN_BITS];
+        if(c.count * size < POOL_CACHE_LIMIT && pool_state != 2) {
+            if(!pool_state) {
+                pool_guard.touch();  // registers the destructor of the thread
+                pool_state = 1;
+            }
+            *(void**)ptr = c.head;
+            c.head = ptr;
+            c.count++;
+            return;
+        }
+    }
+    _free(ptr);
+}
@@ -20,3 +20,19 @@ typedef int64_t i64;
     #define _realloc realloc
     #define _free free
 #endif
+
+
+// size-class pool, blocks from 64b to 64Kb are cached per thread (per loop)
+// a block freed by another thread goes to the list of that thread, so a list is not tied to its loop,
+// it is bounded by POOL_CACHE_LIMIT anyway, and the lists are freed when the thread exits
+#define POOL_MIN_BITS 6
+#define POOL_MAX_BITS 16
+#define POOL_MIN (1 << POOL_MIN_BITS)
+#define POOL_MAX (1 << POOL_MAX_BITS)
+#define POOL_CACHE_LIMIT (1 << 20)  // cached bytes per size class
+
+u32 pool_size(u32 size);
+void *pool_alloc(u32 size);
+void *pool_realloc(void *ptr, u32 size, u32 new_size, u32 used);
+void pool_free(void *ptr, u32 size);
+u64 get_pool_mallocs();
@@ -0,0 +1,227 @@
+
+#include <time.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "server.h"
+
+
+void Histogram::add(u64 us) {
+    // log-linear: bounds are 2^k and 1.5 * 2^k
+    int index;
+    if(us <= (1 << HIST_MIN_BITS)) index = 0;
+    else {
+        int k = 63 - __builtin_clzll(us - 1);  // 2^k < us <= 2^(k+1)
+        index = (k - HIST_MIN_BITS) * 2 + 1;
+        if(us > (3ULL << (k - 1))) index++;
+        if(index > HIST_BUCKETS) index = HIST_BUCKETS;
+    }
+    inc(buckets[index]);
+    inc(sum, us);
+}
+
+u64 Histogram::bound(int index) {
+    // upper bound of a bucket, us
+    int k = HIST_MIN_BITS + index / 2;
+    if(index & 1) return 3ULL << (k - 1);
+    return 1ULL << k;
+}
+
+
+static void add_seconds(Buffer &res, u64 us) {
+    res.add_number(us / 1000000);
+    char frac[8];
+    snprintf(frac, sizeof(frac), ".%06d", (int)(us % 1000000));
+    res.add(frac);
+}
+
+static void add_label(Buffer &res, const char *key, ISlice value) {
+    res.add(key);
+    res.add("=\"");
+    char *ptr = value.ptr();
+    for(int i=0;i<value.size();i++) {
+        if(ptr[i] == '"' || ptr[i] == '\\') res.add("\\", 1);
+        if(ptr[i] == '\n') res.add("\\n");
+        else res.add(&ptr[i], 1);
+    }
+    res.add("\"");
+}
+
+static void add_type(Buffer &res, const char *name, const char *type) {
+    res.add("# TYPE ");
+    res.add(name);
+    res.add(" ");
+    res.add(type);
+    res.add("\n");
+}
+
+static void add_value(Buffer &res, const char *name, ISlice method, u64 value) {
+    res.add(name);
+    res.add("{");
+    add_label(res, "method", method);
+    res.add("} ");
+    res.add_number(value);
+    res.add("\n");
+}
+
+static void add_loop_value(Buffer &res, const char *name, int nloop, u64 value) {
+    res.add(name);
+    res.add("{loop=\"");
+    res.add_number(nloop);
+    res.add("\"} ");
+    res.add_number(value);
+    res.add("\n");
+}
+
+static void add_histogram(Buffer &res, const char *name, std::vector<QueueLine*> &queues, int threads, bool service) {
+    add_type(res, name, "histogram");
+    for(auto ql : queues) {
+        u64 buckets[HIST_BUCKETS + 1] = {0};
+        u64 sum = 0;
+        for(int n=0;n<threads;n++) {
+            Histogram &h = service ? ql->metrics[n].service : ql->metrics[n].wait;
+            for(int i=0;i<=HIST_BUCKETS;i++) buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+            sum += h.sum.load(std::memory_order_relaxed);
+        }
+
+        u64 count = 0;
+        for(int i=0;i<=HIST_BUCKETS;i++) {
+            count += buckets[i];
+            res.add(name);
+            res.add("_bucket{");
+            add_label(res, "method", ql->name);
+            res.add(",le=\"");
+            if(i < HIST_BUCKETS) add_seconds(res, Histogram::bound(i));
+            else res.add("+Inf");
+            res.add("\"} ");
+            res.add_number(count);
+            res.add("\n");
+        }
+        res.add(name);
+        res.add("_sum{");
+        add_label(res, "method", ql->name);
+        res.add("} ");
+        add_seconds(res, sum);
+        res.add("\n");
+        res.add(name);
+        res.add("_count{");
+        add_label(res, "method", ql->name);
+        res.add("} ");
+        res.add_number(count);
+        res.add("\n");
+    }
+}
+
+#define METHOD_COUNTER(title, field) \
+    add_type(res, title, "counter"); \
+    for(auto ql : queues) { \
+        u64 value = 0; \
+        for(int n=0;n<threads;n++) value += ql->metrics[n].field.load(std::memory_order_relaxed); \
+        add_value(res, title, ql->name, value); \
+    }
+
+#define LOOP_COUNTER(title, field) \
+    add_type(res, title, "counter"); \
+    for(int n=0;n<threads;n++) add_loop_value(res, title, n, server->loops[n]->metrics.field.load(std::memory_order_relaxed));
+
+
+void render_metrics(Server *server, Buffer &res) {
+    // Prometheus text format
+    std::vector<QueueLine*> queues;
+    server->get_queues(queues);
+    int threads = server->threads;
+
+    METHOD_COUNTER("ijson_requests_total", requests);
+    METHOD_COUNTER("ijson_results_total", results);
+    METHOD_COUNTER("ijson_errors_4xx_total", errors_4xx);
+    METHOD_COUNTER("ijson_errors_5xx_total", errors_5xx);
+    METHOD_COUNTER("ijson_shed_total", shed);
+    METHOD_COUNTER("ijson_coalesced_total", coalesced);
+    METHOD_COUNTER("ijson_broadcasts_total", broadcasts);
+    METHOD_COUNTER("ijson_broadcast_deliveries_total", broadcast_deliveries);
+    if(server->peers.size()) {
+        METHOD_COUNTER("ijson_forwarded_total", forwarded);
+    }
+    if(server->cache) {
+        METHOD_COUNTER("ijson_cache_hits_total", cache_hits);
+        METHOD_COUNTER("ijson_cache_misses_total", cache_misses);
+    }
+
+    add_type(res, "ijson_queued_clients", "gauge");
+    for(auto ql : queues) add_value(res, "ijson_queued_clients", ql->name, ql->queued);
+    add_type(res, "ijson_queued_bytes", "gauge");
+    for(auto ql : queues) add_value(res, "ijson_queued_bytes", ql->name, ql->queued_bytes);
+    add_type(res, "ijson_inflight", "gauge");
+    for(auto ql : queues) add_value(res, "ijson_inflight", ql->name, ql->inflight);
+
+    add_histogram(res, "ijson_queue_wait_seconds", queues, threads, false);
+    add_histogram(res, "ijson_service_seconds", queues, threads, true);
+
+    LOOP_COUNTER("ijson_loop_events_total", events);
+    LOOP_COUNTER("ijson_loop_epoll_wait_total", epoll_waits);
+    LOOP_COUNTER("ijson_loop_recv_total", recv_calls);
+    LOOP_COUNTER("ijson_loop_send_total", send_calls);
+    LOOP_COUNTER("ijson_loop_received_bytes_total", bytes_received);
+    LOOP_COUNTER("ijson_loop_sent_bytes_total", bytes_sent);
+    if(server->wal_dir) {
+        LOOP_COUNTER("ijson_loop_wal_syncs_total", wal_syncs);
+        LOOP_COUNTER("ijson_loop_wal_acks_total", wal_acks);
+    }
+
+    add_type(res, "ijson_loop_cpu_seconds_total", "counter");
+    for(int n=0;n<threads;n++) {
+        clockid_t cid;
+        struct timespec spec;
+        if(pthread_getcpuclockid(server->loops[n]->get_id(), &cid)) continue;
+        if(clock_gettime(cid, &spec)) continue;
+        res.add("ijson_loop_cpu_seconds_total{loop=\"");
+        res.add_number(n);
+        res.add("\"} ");
+        add_seconds(res, (u64)spec.tv_sec * 1000000 + spec.tv_nsec / 1000);
+        res.add("\n");
+    }
+
+    if(server->cache) {
+        CacheStats stats;
+        server->cache->get_stats(stats);
+        add_type(res, "ijson_cache_evictions_total", "counter");
+        res.add("ijson_cache_evictions_total ");
+        res.add_number(stats.evictions);
+        res.add("\n");
+        add_type(res, "ijson_cache_expired_total", "counter");
+        res.add("ijson_cache_expired_total ");
+        res.add_number(stats.expired);
+        res.add("\n");
+        add_type(res, "ijson_cache_entries", "gauge");
+        res.add("ijson_cache_entries ");
+        res.add_number(stats.entries);
+        res.add("\n");
+        add_type(res, "ijson_cache_bytes", "gauge");
+        res.add("ijson_cache_bytes ");
+        res.add_number(stats.bytes);
+        res.add("\n");
+    }
+
+    StoreStats store;
+    server->results->get_stats(store);
+    add_type(res, "ijson_async_pending", "gauge");
+    res.add("ijson_async_pending ");
+    res.add_number(store.pending);
+    res.add("\n");
+    add_type(res, "ijson_async_results", "gauge");
+    res.add("ijson_async_results ");
+    res.add_number(store.done);
+    res.add("\n");
+    add_type(res, "ijson_async_results_bytes", "gauge");
+    res.add("ijson_async_results_bytes ");
+    res.add_number(store.bytes);
+    res.add("\n");
+    add_type(res, "ijson_async_evictions_total", "counter");
+    res.add("ijson_async_evictions_total ");
+    res.add_number(store.evictions);
+    res.add("\n");
+
+    add_type(res, "ijson_buffer_mallocs_total", "counter");
+    res.add("ijson_buffer_mallocs_total ");
+    res.add_number(get_pool_mallocs());
+    res.add("\n");
+}
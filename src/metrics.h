@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include "utils.h"
+
+
+#define HIST_MIN_BITS 6  // first bucket is up to 64us
+#define HIST_BUCKETS 40  // 2 buckets per power of two, up to ~50s, plus +Inf
+#define CACHE_LINE 64
+
+
+// counters are written by the own loop only and merged on scrape
+inline void inc(std::atomic<u64> &counter, u64 value=1) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+class Histogram {
+public:
+    std::atomic<u64> buckets[HIST_BUCKETS + 1];
+    std::atomic<u64> sum{0};  // us
+
+    Histogram() {
+        for(int i=0;i<=HIST_BUCKETS;i++) buckets[i] = 0;
+    }
+    void add(u64 us);
+    static u64 bound(int index);
+};
+
+
+class alignas(CACHE_LINE) MethodMetrics {
+public:
+    std::atomic<u64> requests{0};
+    std::atomic<u64> results{0};
+    std::atomic<u64> errors_4xx{0};
+    std::atomic<u64> errors_5xx{0};
+    std::atomic<u64> shed{0};
+    std::atomic<u64> cache_hits{0};
+    std::atomic<u64> cache_misses{0};
+    std::atomic<u64> coalesced{0};
+    std::atomic<u64> broadcasts{0};
+    std::atomic<u64> broadcast_deliveries{0};  // workers got a broadcast
+    std::atomic<u64> forwarded{0};  // to other nodes
+    Histogram wait;  // from request to a worker
+    Histogram service;  // from a worker to a result
+};
+
+
+class alignas(CACHE_LINE) LoopMetrics {
+public:
+    std::atomic<u64> events{0};
+    std::atomic<u64> epoll_waits{0};
+    std::atomic<u64> recv_calls{0};
+    std::atomic<u64> send_calls{0};
+    std::atomic<u64> bytes_received{0};
+    std::atomic<u64> bytes_sent{0};
+    std::atomic<u64> wal_syncs{0};
+    std::atomic<u64> wal_acks{0};  // clients acknowledged by the syncs
+};
+
+
+class Server;
+void render_metrics(Server *server, Buffer &res);
@@ -0,0 +1,210 @@
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "peer.h"
+#include "server.h"
+#include "log.h"
+
+
+/*
+    A link to another node: requests only, the peer doesn't answer on it.
+    Calls, results and summaries of idle workers are written by one thread per peer,
+    results of forwarded calls come back over the link of the peer.
+*/
+
+
+u32 peer_hash(const char *p, int size) {
+    // FNV-1a, the same on all nodes
+    u32 h = 2166136261u;
+    for(int i=0;i<size;i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+void Peer::start() {
+    _thread = std::thread(&Peer::_run, this);
+}
+
+void Peer::_run() {
+    long summary_at = 0;
+    std::string out;
+    while(true) {
+        if(_fd < 0 && !_connect()) {
+            sleep(1);
+            continue;
+        }
+        out.clear();
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait_for(lock, std::chrono::milliseconds(PEER_SUMMARY_MS), [this] {return !_out.empty();});
+            out.swap(_out);
+        }
+        long now = get_time_ms();
+        if(now - summary_at >= PEER_SUMMARY_MS) {
+            summary_at = now;
+            _add_summary(out);
+        }
+        if(!_write(out)) {
+            _fail();
+            continue;
+        }
+
+        // the peer never writes, readable means closed
+        struct pollfd p = {_fd, POLLIN, 0};
+        if(poll(&p, 1, 0) > 0) _fail();
+    }
+}
+
+bool Peer::_connect() {
+    size_t colon = name.rfind(':');
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(name.substr(0, colon).c_str());
+    addr.sin_port = htons(atoi(name.c_str() + colon + 1));
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return false;
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        return false;
+    }
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    _fd = fd;
+    LOCK _l(_mutex);
+    _connected = true;
+    if(_server->log & 8) Log(8) << "peer connected " << name;
+    return true;
+}
+
+bool Peer::_write(const std::string &data) {
+    size_t pos = 0;
+    while(pos < data.size()) {
+        int sent = ::send(_fd, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        pos += sent;
+    }
+    return true;
+}
+
+void Peer::_fail() {
+    // forwarded calls without results fail on loop 0
+    ::close(_fd);
+    _fd = -1;
+    std::vector<std::string> failed;
+    {
+        LOCK _l(_mutex);
+        _connected = false;
+        _idle.clear();
+        _out.clear();
+        failed.assign(_calls.begin(), _calls.end());
+        _calls.clear();
+    }
+    if(_server->log & 4) Log(4) << "peer disconnected " << name << ", calls failed: " << failed.size();
+    if(failed.empty()) return;
+    {
+        LOCK _l(_server->peer_lock);
+        for(auto &id : failed) _server->peer_failed.push_back(id);
+    }
+    _server->loops[0]->wake();
+}
+
+void Peer::_add_summary(std::string &out) {
+    // "name\tidle\n" of methods with waiting workers
+    std::vector<QueueLine*> queues;
+    _server->get_queues(queues);
+    std::string body;
+    for(auto ql : queues) {
+        int idle = 0;
+        ql->mutex.lock();
+        for(int n=0;n<_server->threads;n++) idle += ql->queue[n].workers.size();
+        ql->mutex.unlock();
+        if(!idle) continue;
+        body.append(ql->name.ptr(), ql->name.size());
+        body += '\t';
+        body += std::to_string(idle);
+        body += '\n';
+    }
+    out += "POST /rpc/peer/summary HTTP/1.1\r\nPeer: " + _server->node_name + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    out += body;
+}
+
+void Peer::_add_message(const char *path, ISlice &id, ISlice *name, ISlice *body, const char *extra) {
+    // under _mutex
+    _out += "POST ";
+    _out += path;
+    _out += " HTTP/1.1\r\nPeer: " + _server->node_name + "\r\nId: ";
+    _out.append(id.ptr(), id.size());
+    if(name) {
+        _out += "\r\nName: ";
+        _out.append(name->ptr(), name->size());
+    }
+    _out += "\r\n";
+    _out += extra;
+    _out += "Content-Length: " + std::to_string(body ? body->size() : 0) + "\r\n\r\n";
+    if(body) _out.append(body->ptr(), body->size());
+    _cv.notify_one();
+}
+
+void Peer::send_call(ISlice &id, ISlice &method, ISlice &body, int priority, long timeout) {
+    std::string extra = "Priority: " + std::to_string(priority) + "\r\n";
+    if(timeout) extra += "Timeout: " + std::to_string(timeout) + "\r\n";
+    LOCK _l(_mutex);
+    _calls.insert(id.as_string());
+    _add_message("/rpc/peer/call", id, &method, &body, extra.c_str());
+}
+
+void Peer::send_result(ISlice &id, ISlice *result) {
+    // result is NULL for a failed call
+    LOCK _l(_mutex);
+    _add_message("/rpc/peer/result", id, NULL, result, result ? "" : "Option: error\r\n");
+}
+
+void Peer::call_done(ISlice &id) {
+    LOCK _l(_mutex);
+    _calls.erase(id.as_string());
+}
+
+void Peer::set_summary(ISlice &body) {
+    std::unordered_map<std::string, int> idle;
+    const char *p = body.ptr();
+    const char *end = p + body.size();
+    while(p < end) {
+        const char *tab = (const char*)memchr(p, '\t', end - p);
+        if(!tab) break;
+        const char *eol = (const char*)memchr(tab, '\n', end - tab);
+        if(!eol) break;
+        idle[std::string(p, tab - p)] = atoi(std::string(tab + 1, eol - tab - 1).c_str());
+        p = eol + 1;
+    }
+    LOCK _l(_mutex);
+    _idle.swap(idle);
+    _summary_at = get_time_ms();
+}
+
+bool Peer::has_idle(ISlice &method) {
+    LOCK _l(_mutex);
+    if(!_connected || get_time_ms() - _summary_at > PEER_SUMMARY_TTL) return false;
+    auto it = _idle.find(method.as_string());
+    return it != _idle.end() && it->second > 0;
+}
+
+bool Peer::take_idle(ISlice &method) {
+    // an idle worker is counted down until the next summary
+    LOCK _l(_mutex);
+    if(!_connected || get_time_ms() - _summary_at > PEER_SUMMARY_TTL) return false;
+    auto it = _idle.find(method.as_string());
+    if(it == _idle.end() || it->second <= 0) return false;
+    it->second--;
+    return true;
+}
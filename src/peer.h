@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "utils.h"
+
+
+#define PEER_SUMMARY_MS 100  // idle workers are sent to a peer this often
+#define PEER_SUMMARY_TTL 1000  // ms, an older summary is ignored
+#define PEER_RING_POINTS 64  // per node
+
+
+class Server;
+
+
+class Peer {
+private:
+    Server *_server;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::string _out;  // messages to the peer
+    std::unordered_set<std::string> _calls;  // ids of forwarded calls without a result
+    std::unordered_map<std::string, int> _idle;  // method -> idle workers of the peer
+    long _summary_at = 0;  // ms
+    bool _connected = false;
+    int _fd = -1;
+
+    void _run();
+    bool _connect();
+    bool _write(const std::string &data);
+    void _fail();
+    void _add_summary(std::string &out);
+    void _add_message(const char *path, ISlice &id, ISlice *name, ISlice *body, const char *extra);
+public:
+    std::string name;  // host:port
+    int index = 0;
+
+    Peer(Server *server, const std::string &name) : _server(server), name(name) {};
+    void start();
+    void send_call(ISlice &id, ISlice &method, ISlice &body, int priority, long timeout);
+    void send_result(ISlice &id, ISlice *result);
+    void call_done(ISlice &id);
+    void set_summary(ISlice &body);
+    bool take_idle(ISlice &method);
+    bool has_idle(ISlice &method);
+};
+
+
+u32 peer_hash(const char *p, int size);
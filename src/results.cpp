@@ -0,0 +1,104 @@
+#include <string_view>
+#include <algorithm>
+#include "results.h"
+
+
+/*
+    Results of async calls by job id, kept until the ttl or dropped for space, oldest first.
+    A pending entry is added on submit, so a result of an unknown id is not stored.
+    Pending entries count in the size too, a submit is rejected when they fill a shard.
+*/
+
+
+StoreShard &ResultStore::_shard(ISlice &id) {
+    std::hash<std::string_view> h;
+    return _shards[h(std::string_view(id.ptr(), id.size())) % STORE_SHARDS];
+}
+
+void ResultStore::_erase(StoreShard &shard, std::list<StoreEntry>::iterator it) {
+    // done entries only
+    shard.bytes -= it->result.size() + it->id.size() + STORE_ENTRY_OVERHEAD;
+    shard.map.erase(it->id);
+    shard.done.erase(it);
+}
+
+bool ResultStore::add(ISlice &id, bool force) {
+    // false if pending entries fill the shard, results are dropped for space first
+    StoreShard &shard = _shard(id);
+    LOCK _l(shard.mutex);
+    i64 size = id.size() + STORE_ENTRY_OVERHEAD;
+    while(shard.done.size() && shard.bytes + size > _shard_size) {
+        shard.evictions++;
+        _erase(shard, std::prev(shard.done.end()));
+    }
+    if(!force && shard.bytes + size > _shard_size) return false;
+    shard.pending.emplace_front();
+    auto it = shard.pending.begin();
+    it->id = id.as_string();
+    shard.map[it->id] = it;
+    shard.bytes += size;
+    return true;
+}
+
+void ResultStore::put(ISlice &id, ISlice *result, long expire, long now, std::vector<Connect*> &waiters) {
+    // result is NULL for a failed job, waiters get the result
+    StoreShard &shard = _shard(id);
+    LOCK _l(shard.mutex);
+    auto found = shard.map.find(id.as_string());
+    if(found == shard.map.end() || found->second->state != STORE_PENDING) return;
+    auto it = found->second;
+    waiters.swap(it->waiters);
+    it->state = result ? STORE_DONE : STORE_FAILED;
+    it->expire = expire;
+    if(result) it->result.assign(result->ptr(), result->size());
+    shard.done.splice(shard.done.begin(), shard.pending, it);
+    shard.bytes += it->result.size();
+
+    while(shard.done.size() > 1 && (shard.bytes > _shard_size || shard.done.back().expire <= now)) {
+        if(shard.done.back().expire > now) shard.evictions++;
+        _erase(shard, std::prev(shard.done.end()));
+    }
+}
+
+int ResultStore::fetch(ISlice &id, Connect *waiter, long now, Buffer &result) {
+    // a pending entry keeps the waiter if it's set
+    StoreShard &shard = _shard(id);
+    LOCK _l(shard.mutex);
+    auto found = shard.map.find(id.as_string());
+    if(found == shard.map.end()) return STORE_NONE;
+    auto it = found->second;
+    if(it->state == STORE_PENDING) {
+        if(waiter) it->waiters.push_back(waiter);
+        return STORE_PENDING;
+    }
+    if(it->expire <= now) {
+        _erase(shard, it);
+        return STORE_NONE;
+    }
+    result.set(it->result.data(), it->result.size());
+    return it->state;
+}
+
+bool ResultStore::cancel(ISlice &id, Connect *waiter) {
+    // false if the waiter has got a result already
+    StoreShard &shard = _shard(id);
+    LOCK _l(shard.mutex);
+    auto found = shard.map.find(id.as_string());
+    if(found == shard.map.end()) return false;
+    auto &waiters = found->second->waiters;
+    auto it = std::find(waiters.begin(), waiters.end(), waiter);
+    if(it == waiters.end()) return false;
+    waiters.erase(it);
+    return true;
+}
+
+void ResultStore::get_stats(StoreStats &stats) {
+    for(int i=0;i<STORE_SHARDS;i++) {
+        StoreShard &shard = _shards[i];
+        LOCK _l(shard.mutex);
+        stats.pending += shard.pending.size();
+        stats.done += shard.done.size();
+        stats.bytes += shard.bytes;
+        stats.evictions += shard.evictions;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "utils.h"
+#include "metrics.h"
+
+
+#define STORE_SHARDS 16
+#define STORE_ENTRY_OVERHEAD 128  // list and map nodes, id
+
+#define STORE_NONE 0
+#define STORE_PENDING 1
+#define STORE_DONE 2
+#define STORE_FAILED 3
+
+
+class Connect;
+
+
+class StoreEntry {
+public:
+    std::string id;
+    int state = STORE_PENDING;
+    long expire = 0;  // ms, loop time, set with a result
+    std::string result;
+    std::vector<Connect*> waiters;  // linked clients of /rpc/fetch
+};
+
+
+class alignas(CACHE_LINE) StoreShard {
+public:
+    std::mutex mutex;
+    std::list<StoreEntry> pending;
+    std::list<StoreEntry> done;  // the oldest result last
+    std::unordered_map<std::string, std::list<StoreEntry>::iterator> map;
+    i64 bytes = 0;  // pending and done entries
+    u64 evictions = 0;  // dropped for space before expiration, under mutex
+};
+
+
+class StoreStats {
+public:
+    u64 pending = 0;
+    u64 done = 0;
+    i64 bytes = 0;
+    u64 evictions = 0;
+};
+
+
+class ResultStore {
+private:
+    StoreShard _shards[STORE_SHARDS];
+    i64 _shard_size;
+    StoreShard &_shard(ISlice &id);
+    void _erase(StoreShard &shard, std::list<StoreEntry>::iterator it);
+public:
+    ResultStore(i64 size) : _shard_size(size / STORE_SHARDS) {};
+    bool add(ISlice &id, bool force=false);
+    void put(ISlice &id, ISlice *result, long expire, long now, std::vector<Connect*> &waiters);
+    int fetch(ISlice &id, Connect *waiter, long now, Buffer &result);
+    bool cancel(ISlice &id, Connect *waiter);
+    void get_stats(StoreStats &stats);
+};
@@ -10,8 +10,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
+#include <algorithm>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include "connect.h"
 #include "balancer.h"
 
@@ -43,7 +45,7 @@ void Server::_listen() {
     if(r < 0) THROW("Error on binding, port is busy?");  // fix vscode highlighting
 
     if(listen(_fd, 64) < 0) THROW("ERROR on listen");
-    if(this->log & 8) std::cout << ltime() << "Server started on " << host.as_string() << ":" << port << std::endl;
+    if(this->log & 8) Log(8) << "Server started on " << host << ":" << port;
 };
 
 
@@ -61,54 +63,217 @@ bool Server::_valid_ip(u32 ip) {
 
 void Server::_accept() {
     while (true) {
+        if(handover_path && !_wait_accept()) continue;
         struct sockaddr_in peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
         int fd = accept(_fd, (struct sockaddr *)&peer_addr, &peer_addr_len);
         if(fd < 0) {
-            if(log & 1) std::cout << ltime() << "warning: accept error\n";
+            if(log & 1) Log(1) << "warning: accept error";
             continue;
         }
         if(fd >= MAX_EVENTS) {
-            std::cout << "socket fd (" << fd << ") >= " << MAX_EVENTS << std::endl;
+            Log(1) << "socket fd (" << fd << ") >= " << MAX_EVENTS;
             THROW("socket fd error");
         }
         unblock_socket(fd);
 
         if(!_valid_ip(peer_addr.sin_addr.s_addr)) {
             close(fd);
-            if(log & 8) std::cout << ltime() << "Client filtered\n";
+            if(log & 8) Log(8) << "Client filtered";
             continue;
         };
 
         if(connections[fd]) THROW("Connection place is not empty");
         Connect* conn = new Connect(this, fd);
+        if(trace_rate) conn->accept_us = get_time_us();
         connections[fd] = conn;
         conn->link();
 
         if(fd > max_fd) max_fd = fd;
-        if(log & 16) std::cout << ltime() << "connect " << fd << " " << (void*)conn << std::endl;
+        if(log & 16) Log(16) << "connect " << fd << " " << (void*)conn;
 
-        loops[active_loop]->accept(conn);
+        loops[cpu_loop.size() ? _incoming_loop(fd) : active_loop]->accept(conn);
     }
 };
 
 
+int Server::_incoming_loop(int fd) {
+    // the loop on the cpu which gets packets of the connection, if it's not overloaded
+    #ifdef SO_INCOMING_CPU
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0 && cpu < (int)cpu_loop.size()) {
+            int n = cpu_loop[cpu];
+            if(n >= 0 && !(hot_loops & (1ULL << n))) return n;
+        }
+    #endif
+    return active_loop;
+}
+
+
+void Server::_place_loops() {
+    // loops pin themselves: to listed cpus, or to cpus of nodes in turn with --numa only
+    if(cpus.size()) {
+        for(int i=0;i<threads;i++) {
+            int cpu = cpus[i % cpus.size()];
+            loops[i]->cpus = {cpu};
+            if(numa) loops[i]->node = cpu_node(cpu);
+            if(cpu >= (int)cpu_loop.size()) cpu_loop.resize(cpu + 1, -1);
+            if(cpu_loop[cpu] == -1) cpu_loop[cpu] = i;
+        }
+        if(!pin_thread(cpus) && log & 4) Log(4) << "accept thread is not pinned";
+    } else if(numa) {
+        int nodes = numa_nodes();
+        for(int i=0;i<threads;i++) {
+            loops[i]->node = i % nodes;
+            node_cpus(loops[i]->node, loops[i]->cpus);
+        }
+    }
+}
+
+
+bool Server::_wait_accept() {
+    // the listening socket, a new process and workers of the old one; false - nothing to accept
+    if(draining) {
+        if(_drained()) {
+            if(log & 8) Log(8) << "handover: drained, exit";
+            log_flush();
+            _exit(0);
+        }
+        usleep(100'000);
+        return false;
+    }
+    struct pollfd fds[3] = {{_fd, POLLIN, 0}, {_handover_fd, POLLIN, 0}, {_handover_in, POLLIN, 0}};
+    if(poll(fds, 3, -1) <= 0) return false;
+    if(fds[2].revents) _handover_worker();
+    if(fds[1].revents & POLLIN) {
+        _handover_give();
+        return false;
+    }
+    return fds[0].revents & POLLIN;
+}
+
+
+void Server::_handover_give() {
+    // the new process takes the listening socket and waiting workers, this one drains
+    int sock = accept(_handover_fd, NULL, NULL);
+    if(sock < 0) return;
+    Slice none("");
+    if(!handover_send(sock, HANDOVER_LISTEN, none, _fd)) {
+        if(log & 2) Log(2) << "handover: listening socket is not sent";
+        close(sock);
+        return;
+    }
+    close(_fd);
+    close(_handover_fd);
+    if(_handover_in >= 0) close(_handover_in);
+    _handover_in = -1;
+    handover_out = sock;
+    _drain_until = get_time_ms() + HANDOVER_DRAIN * 1000;
+    draining = true;
+    for(int i=0;i<threads;i++) loops[i]->wake();
+    if(log & 8) Log(8) << "handover: listening socket is sent, draining";
+}
+
+
+void Server::_handover_worker() {
+    // a waiting worker of the old process gets tasks here
+    char type;
+    Buffer data;
+    int fd = handover_recv(_handover_in, type, data);
+    if(!type) {
+        if(log & 8) Log(8) << "handover: the old process is gone, workers taken: " << _handover_count;
+        close(_handover_in);
+        _handover_in = -1;
+        return;
+    }
+    if(fd < 0) return;
+    if(type != HANDOVER_WORKER || data.empty() || fd >= MAX_EVENTS || connections[fd]) {
+        close(fd);
+        return;
+    }
+    int flags = data.ptr()[0] - '0';
+    Slice names(data.ptr() + 1, data.size() - 1);
+
+    Connect *conn = new Connect(this, fd);
+    conn->restore_worker(flags, names);
+    connections[fd] = conn;
+    conn->link();
+    if(fd > max_fd) max_fd = fd;
+    if(log & 16) Log(16) << "handover worker " << fd << " " << (void*)conn;
+    loops[_handover_count++ % threads]->adopt_worker(conn);
+}
+
+
+bool Server::_drained() {
+    if(get_time_ms() >= _drain_until) return true;
+    for(int i=0;i<=max_fd;i++) {
+        if(connections[i]) return false;
+    }
+    return true;
+}
+
+
 void Server::start() {
-    _listen();
+    log_start(log_json);
+    if(handover_path) {
+        _handover_in = handover_connect(handover_path);
+        if(_handover_in >= 0) {
+            char type;
+            Buffer data;
+            _fd = handover_recv(_handover_in, type, data);
+            if(type != HANDOVER_LISTEN || _fd < 0) THROW("handover: no listening socket");
+            if(log & 8) Log(8) << "Server took over " << host << ":" << port;
+        }
+    }
+    if(_fd < 0) _listen();
 
     if(threads < 1) threads = 1;
     if(threads > 62) {
         threads = 62;
-        if(log & 4) std::cout << "max threads is 62\n";
+        if(log & 4) Log(4) << "max threads is 62";
     }
+    capture_start = get_time_us();
+    if(cache_size) cache = new ResultCache(cache_size);
+    results = new ResultStore(results_size);
     loops = (Loop**)_malloc(sizeof(Loop*) * threads);
 
-    for(int i=0; i<threads; i++) {
-        Loop *loop = new Loop(this, i);
-        loop->start();
-        loops[i] = loop;
+    std::vector<WalJob> jobs;
+    std::vector<std::string> old_files;
+    if(wal_dir) wal_gen = wal_load(wal_dir, jobs, old_files);
+
+    for(int i=0; i<threads; i++) loops[i] = new Loop(this, i);
+    if(wal_dir) {
+        // pending jobs are written to new logs before old ones are removed
+        for(size_t i=0;i<jobs.size();i++) loops[i % threads]->restore_job(jobs[i]);
+        for(int i=0; i<threads; i++) loops[i]->wal->sync();
+        for(auto &path : old_files) unlink(path.c_str());
+        if(old_files.size()) wal_sync_dir(wal_dir);
+        if(log & 8) Log(8) << "restored jobs: " << jobs.size();
+    }
+    _place_loops();
+    for(int i=0; i<threads; i++) loops[i]->start();
+
+    if(peer_names.size()) {
+        std::vector<std::pair<std::string, Peer*>> nodes = {{node_name, NULL}};
+        for(auto &name : peer_names) {
+            Peer *peer = new Peer(this, name);
+            peer->index = peers.size();
+            peers.push_back(peer);
+            nodes.push_back({name, peer});
+        }
+        for(auto &node : nodes) {
+            for(int i=0;i<PEER_RING_POINTS;i++) {
+                std::string point = node.first + "#" + std::to_string(i);
+                ring.push_back({peer_hash(point.data(), point.size()), node.second});
+            }
+        }
+        std::sort(ring.begin(), ring.end(), [](const std::pair<u32, Peer*> &a, const std::pair<u32, Peer*> &b) {return a.first < b.first;});
+        for(auto peer : peers) peer->start();
     }
 
+    if(handover_path) _handover_fd = handover_listen(handover_path);
+
     Balancer balancer(this);
     balancer.start();
 
@@ -136,11 +301,176 @@ QueueLine *Server::get_queue(ISlice key, bool create) {
 
     QueueLine *ql = new QueueLine(threads);
     ql->name.set(key);
+    ql->limits = limits;
+    ql->coalesce = limits.coalesce;
+    ql->cache_ttl = limits.cache;
+    ql->weight = get_weight(key);
+    ql->durable = is_durable(key);
+    ql->pass = fair_pass.load();
     _queue_list.push_back(ql);
     _mapper.add(key, _queue_list.size());
 
     return ql;
 }
+void Server::get_queues(std::vector<QueueLine*> &result) {
+    // queues are never deleted, so the list can be used without the lock
+    LOCK _l(global_lock);
+    result = _queue_list;
+}
+
+bool Server::coalesce(QueueLine *ql, Connect *client) {
+    // attaches a client to the same call in flight, or makes it a leader
+    Slice key = client->get_key();
+    if(!client->cache_hash) client->cache_hash = ResultCache::hash(ql->name, key);
+    LOCK _l(coalesce_lock);
+    auto it = coalesce_calls.find(client->cache_hash);
+    if(it == coalesce_calls.end()) {
+        coalesce_calls[client->cache_hash] = {ql, client};
+        client->coalesce_leader = true;
+        return false;
+    }
+    Connect *leader = it->second.second;
+    if(it->second.first != ql) return false;
+    Slice leader_key = leader->get_key();
+    if(leader_key.size() != key.size() || memcmp(leader_key.ptr(), key.ptr(), key.size())) return false;
+    client->get_id();  // for the reply, from the body of a json call too
+    client->follow_next = leader->followers;
+    leader->followers = client;
+    client->link();
+    client->status = Status::client_wait_result;
+    return true;
+}
+
+void Server::coalesce_done(Connect *leader, Connect *worker) {
+    // sends a result of the leader to followers, 503 if there is no result
+    coalesce_lock.lock();
+    auto it = coalesce_calls.find(leader->cache_hash);
+    if(it != coalesce_calls.end() && it->second.second == leader) coalesce_calls.erase(it);
+    leader->coalesce_leader = false;
+    Connect *follower = leader->followers;
+    leader->followers = NULL;
+    coalesce_lock.unlock();
+
+    while(follower) {
+        Connect *next = follower->follow_next;
+        follower->follow_next = NULL;
+        if(!follower->is_closed()) {
+            follower->send.status(worker ? "200 OK" : "503 Service Unavailable");
+            follower->send.header("Id", follower->id);
+            if(worker) follower->send.done(worker->body);
+            else follower->send.done(-1);
+        }
+        follower->status = Status::net;
+        follower->unlink();
+        follower = next;
+    }
+}
+
+int Server::get_weight(ISlice name) {
+    // exact name, then the longest prefix
+    int result = 1;
+    int best = -1;
+    for(const auto &it : weights) {
+        const std::string &key = it.first;
+        if(!key.empty() && key.back() == '*') {
+            int size = key.size() - 1;
+            if(size <= best || size > name.size()) continue;
+            if(memcmp(key.data(), name.ptr(), size)) continue;
+            best = size;
+            result = it.second;
+        } else if(name == key.c_str()) {
+            return it.second;
+        }
+    }
+    return result;
+}
+
+bool Server::is_durable(ISlice name) {
+    for(const auto &key : durable) {
+        if(!key.empty() && key.back() == '*') {
+            int size = key.size() - 1;
+            if(size <= name.size() && !memcmp(key.data(), name.ptr(), size)) return true;
+        } else if(name == key.c_str()) return true;
+    }
+    return false;
+}
+
+
+Peer *Server::find_peer(ISlice name) {
+    for(auto peer : peers) {
+        if(name == peer->name.c_str()) return peer;
+    }
+    return NULL;
+}
+
+bool Server::remote_idle(ISlice method) {
+    for(auto peer : peers) {
+        if(peer->has_idle(method)) return true;
+    }
+    return false;
+}
+
+Peer *Server::pick_peer(ISlice method) {
+    // nodes in ring order from the hash of the method, the first one with an idle worker
+    u32 hash = peer_hash(method.ptr(), method.size());
+    auto it = std::lower_bound(ring.begin(), ring.end(), hash, [](const std::pair<u32, Peer*> &a, u32 h) {return a.first < h;});
+    u64 tried = 0;
+    for(size_t i=0;i<ring.size();i++, it++) {
+        if(it == ring.end()) it = ring.begin();
+        Peer *peer = it->second;
+        if(!peer || peer->index >= 64 || (tried & (1ULL << peer->index))) continue;
+        tried |= 1ULL << peer->index;
+        if(peer->take_idle(method)) return peer;
+    }
+    return NULL;
+}
+
+
+/* ClientQueue */
+
+int ClientQueue::level(int priority) {
+    int level = priority + PRIORITY_LEVELS / 2;
+    if(level < 0) return 0;
+    if(level >= PRIORITY_LEVELS) return PRIORITY_LEVELS - 1;
+    return level;
+}
+
+void ClientQueue::push(Connect *client) {
+    int level = ClientQueue::level(client->priority);
+    client->wait_level = level;
+    client->wait_next = NULL;
+    client->wait_prev = _tail[level];
+    if(_tail[level]) _tail[level]->wait_next = client;
+    else _head[level] = client;
+    _tail[level] = client;
+    _bits |= 1ULL << level;
+    _size++;
+}
+
+Connect *ClientQueue::pop() {
+    // the oldest client of the highest priority
+    if(!_bits) return NULL;
+    Connect *client = _head[63 - __builtin_clzll(_bits)];
+    remove(client);
+    return client;
+}
+
+Connect *ClientQueue::lowest() {
+    // the oldest client of the lowest priority
+    if(!_bits) return NULL;
+    return _head[__builtin_ctzll(_bits)];
+}
+
+void ClientQueue::remove(Connect *client) {
+    int level = client->wait_level;
+    if(client->wait_prev) client->wait_prev->wait_next = client->wait_next;
+    else _head[level] = client->wait_next;
+    if(client->wait_next) client->wait_next->wait_prev = client->wait_prev;
+    else _tail[level] = client->wait_prev;
+    if(!_head[level]) _bits &= ~(1ULL << level);
+    client->wait_prev = client->wait_next = NULL;
+    _size--;
+}
 
 
 /* Loop */
@@ -148,6 +478,19 @@ QueueLine *Server::get_queue(ISlice key, bool create) {
 Loop::Loop(Server *server, int nloop) {
     this->server = server;
     _nloop = nloop;
+    if(server->trace_rate) traces = new TraceRing();
+    epollfd = epoll_create1(0);
+    if(epollfd < 0) THROW("epoll_create1");
+    if(server->capture_path) {
+        std::string path = std::string(server->capture_path) + "." + std::to_string(nloop);
+        capture = new Capture();
+        capture->body = server->capture_body;
+        capture->open(path.c_str(), server->capture_start);
+    }
+    if(server->wal_dir) {
+        wal = new Wal();
+        wal->open(server->wal_dir, server->wal_gen, nloop);
+    }
 };
 
 
@@ -168,6 +511,79 @@ void Loop::accept(Connect *conn) {
     if(st & 1) event.events |= EPOLLIN;
     if(st & 2) event.events |= EPOLLOUT;
     if(epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->fd, &event) < 0) THROW("epoll_ctl EPOLL_CTL_ADD");
+
+    if(server->idle_timeout) {
+        // timer is armed by the loop thread
+        conn->active = get_time_ms();
+        LOCK _l(_arm_lock);
+        _arm_list.push_back(conn);
+    }
+}
+
+
+void Loop::adopt_worker(Connect *conn) {
+    // queues are changed by the loop thread
+    conn->link();
+    accept(conn);
+    {
+        LOCK _l(_arm_lock);
+        _adopted.push_back(conn);
+    }
+    wake();
+}
+
+
+void Loop::_drain() {
+    // waiting workers go to the new process
+    for(int i=0;i<=server->max_fd;i++) {
+        Connect *conn = server->connections[i];
+        if(!conn || conn->nloop != _nloop || conn->go_loop || conn->is_closed()) continue;
+        if(conn->status != Status::worker_wait_job || !conn->keep_alive || !conn->is_idle()) continue;
+        conn->mutex.lock();
+        bool taken = conn->status == Status::worker_wait_job;
+        if(taken) conn->status = Status::busy;
+        conn->mutex.unlock();
+        if(!taken) continue;
+
+        int flags = 0;
+        if(conn->noid) flags |= HANDOVER_NOID;
+        if(conn->fail_on_disconnect) flags |= HANDOVER_FAIL_ON_DISCONNECT;
+        if(conn->worker_mode) flags |= HANDOVER_WORKER_MODE;
+        Buffer data(conn->name.size() + 1);
+        char f = '0' + flags;
+        data.add(&f, 1);
+        data.add(conn->name);
+        if(!handover_send(server->handover_out, HANDOVER_WORKER, data, conn->fd)) {
+            if(server->log & 2) Log(2) << "handover: worker is not sent, fd " << conn->fd;  // it reconnects
+        }
+        _close(conn->fd);
+    }
+}
+
+
+void Loop::trace_done(Connect *conn) {
+    // the response is sent, the request goes to the ring
+    Trace *t = traces->begin();
+    t->queue = conn->trace_queue;
+    t->fd = conn->fd;
+    t->loop = _nloop;
+    t->accept_us = conn->accept_us;
+    t->recv_us = conn->recv_us;
+    t->request_us = conn->request_us;
+    t->task_us = conn->task_us;
+    t->result_us = conn->result_us;
+    t->sent_us = get_time_us();
+    traces->commit(t);
+    conn->trace = false;
+    conn->accept_us = 0;
+}
+
+
+void Loop::set_timer(Connect *conn, long expire) {
+    // keeps an earlier timer, it is re-armed on fire
+    if(conn->nloop != _nloop) return;
+    if(conn->timer.active() && conn->timer.expire <= expire) return;
+    _timers.add(&conn->timer, expire);
 }
 
 
@@ -180,33 +596,67 @@ void Loop::wake() {
 
     eitem event = {0};
     event.data.fd = server->fake_fd;
-    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, server->fake_fd, &event) < 0) THROW("epoll_ctl EPOLL_CTL_ADD");
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, server->fake_fd, &event) < 0 && errno != EEXIST) THROW("epoll_ctl EPOLL_CTL_ADD");  // EEXIST - already woken
 }
 
 
 void Loop::_loop_safe() {
+    if(cpus.size() && !pin_thread(cpus) && server->log & 4) Log(4) << "loop " << _nloop << " is not pinned";
+    if(node >= 0 && !prefer_node(node) && server->log & 4) Log(4) << "loop " << _nloop << " has no memory policy";
+    if((cpus.size() || node >= 0) && server->log & 64) Log(64) << "loop " << _nloop << ": cpus " << (int)cpus.size() << " from " << (cpus.size() ? cpus[0] : -1) << ", node " << node;
     try {
         _loop();
     } catch (const Exception &e) {
         if(server->log & 1) e.print("Exception in loop");
     } catch (const std::exception &e) {
-        if(server->log & 1) std::cout << ltime() << "Fatal exception: " << e.what() << std::endl;
+        if(server->log & 1) Log(1) << "Fatal exception: " << e.what();
     }
 }
 
 void Loop::_loop() {
-    epollfd = epoll_create1(0);
-    if(epollfd < 0) THROW("epoll_create1");
-
     eitem events[MAX_EVENTS];
     char buf[BUF_SIZE];
+    now = get_time_ms();
+    _timers.start(now);
     while(true) {
-        int nready = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        int timeout = _timers.timeout(now);
+        if(server->idle_timeout && (timeout == -1 || timeout > 1000)) timeout = 1000;  // arm accepted connections
+        if(_requeue.size() && (timeout == -1 || timeout > 100)) timeout = 100;
+        if(_wal_acks.size()) {
+            int left = _wal_sync_at > now ? _wal_sync_at - now : 0;
+            if(timeout == -1 || timeout > left) timeout = left;
+        }
+        int nready = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+        now = get_time_ms();
+        inc(metrics.epoll_waits);
+        now_us = get_time_us();
+        if(nready > 0) inc(metrics.events, nready);
         if(nready == -1) {
-            if(server->log & 1) std::cout << ltime() << "epoll_wait error: " << errno << std::endl;
+            if(server->log & 1) Log(1) << "epoll_wait error: " << errno;
             continue;
         }
 
+        if(server->idle_timeout) {
+            LOCK _l(_arm_lock);
+            for(Connect *conn : _arm_list) {
+                if(conn->is_closed() || conn->nloop != _nloop) continue;
+                set_timer(conn, conn->active + server->idle_timeout);
+            }
+            _arm_list.clear();
+        }
+
+        if(_adopted.size()) {
+            std::vector<Connect*> adopted;
+            {
+                LOCK _l(_arm_lock);
+                adopted.swap(_adopted);
+            }
+            for(Connect *conn : adopted) {
+                if(!conn->is_closed() && conn->nloop == _nloop) add_worker(conn->name, conn);
+                conn->unlink();
+            }
+        }
+
         bool need_to_migrate = false;
         for (int i = 0; i < nready; i++) {
             int fd = events[i].data.fd;
@@ -216,18 +666,24 @@ void Loop::_loop() {
             }
 
             if(events[i].events & EPOLLERR || events[i].events & EPOLLHUP) {
-                if(server->log & 2) std::cout << "epoll_wait returned EPOLLERR/EPOLLHUP (" << events[i].events << "): " << fd << std::endl;
+                if(server->log & 2) Log(2) << "epoll_wait returned EPOLLERR/EPOLLHUP (" << events[i].events << "): " << fd;
                 _close(fd);
                 continue;
             }
 
             Connect* conn = server->connections[fd];
             if(conn->nloop != _nloop) {
-                if(server->log & 1) std::cout << "loop warning: connection is in wrong loop\n";
+                if(server->log & 1) Log(1) << "loop warning: connection is in wrong loop";
                 continue;
             }
             if(events[i].events & EPOLLIN) {
-                int size = recv(fd, buf, BUF_SIZE, 0);
+                conn->active = now;
+                char *ptr = buf;
+                int for_read = BUF_SIZE;
+                bool direct = conn->recv_direct(ptr, for_read);
+                int size = recv(fd, ptr, for_read, 0);
+                inc(metrics.recv_calls);
+                if(size > 0) inc(metrics.bytes_received, size);
                 if(size == 0) {
                     _close(fd);
                 } else if(size < 0) {
@@ -239,7 +695,8 @@ void Loop::_loop() {
                     }
                 } else {
                     try {
-                        conn->on_recv(buf, size);
+                        if(direct) conn->on_recv_direct(size);
+                        else conn->on_recv(buf, size);
                     } catch (const Exception &e) {
                         if(server->log & 2) e.print("Exception in on_recv");
                         conn->close();
@@ -259,6 +716,18 @@ void Loop::_loop() {
             if(conn->go_loop) need_to_migrate = true;
         }
 
+        Timer *timer;
+        while((timer = _timers.pop(now))) {
+            Connect *conn = (Connect*)timer->owner;
+            _on_timer(conn);
+            if(conn->go_loop) need_to_migrate = true;
+        }
+
+        if(_nloop == 0 && server->peers.size()) _peer_failed();
+        if(_requeue.size() && now >= _requeue_at) _retry_jobs();
+        if(_wal_acks.size() && now >= _wal_sync_at) _wal_commit();
+        if(server->draining) _drain();
+
         if(need_to_migrate) {
             Lock lock = server->autolock(_nloop);
 
@@ -270,7 +739,8 @@ void Loop::_loop() {
                 conn->go_loop = false;
                 if(conn->is_closed()) continue;
                 set_poll_mode(conn->fd, -1);
-                if(server->log & 64) std::cout << "migrate fd " << conn->fd << ", " << _nloop << " -> " << conn->need_loop << std::endl;
+                _timers.remove(&conn->timer);
+                if(server->log & 64) Log(64) << "migrate fd " << conn->fd << ", " << _nloop << " -> " << conn->need_loop;
                 auto loop = server->loops[conn->need_loop];
                 loop->accept(conn);
 
@@ -286,7 +756,7 @@ void Loop::_loop() {
             if(del_lock.try_lock()) {
                 for(Connect *conn : dead_connections) {
                     if(conn->get_link() == 0) {
-                        if(server->log & 16) std::cout << ltime() << "delete connection " << (void*)conn << std::endl;
+                        if(server->log & 16) Log(16) << "delete connection " << (void*)conn;
                         delete conn;
                     }
                 }
@@ -328,9 +798,12 @@ void Loop::set_poll_mode(int fd, int status) {
 
 void Loop::_close(int fd) {
     Connect* conn = server->connections[fd];
-    if(server->log & 16) std::cout << ltime() << "disconnect socket " << fd << " " << (void*)conn << std::endl;
+    if(server->log & 16) Log(16) << "disconnect socket " << fd << " " << (void*)conn;
     if(conn == NULL) THROW("_close: connection is null");
     conn->close();
+    _drop_client(conn, false);  // a gone client doesn't hold a place in the queue
+    conn->release_job();
+    _timers.remove(&conn->timer);
     this->on_disconnect(conn);
     conn->unlink();
     server->connections[fd] = NULL;
@@ -343,19 +816,33 @@ void Loop::add_worker(ISlice name, Connect *worker) {
     int start = 0;
     int i = 0;
     Slice n;
-    for(;i<name.size();i++) {
-        if(ptr[i] == ',' || ptr[i] == ' ') {
-            n.set(&ptr[start], i - start);
-            start = i + 1;
-            if(_add_worker(n, worker) == 1) {
-                // worker is taken
-                return;
-            }
+    _fair_order.clear();
+    for(;i<=name.size();i++) {
+        if(i < name.size() && ptr[i] != ',' && ptr[i] != ' ') continue;
+        if(i == name.size() && start == i) break;
+        n.set(&ptr[start], i - start);
+        start = i + 1;
+        _fair_order.push_back({0, n});
+    }
+
+    if(_fair_order.size() > 1) {
+        // methods with waiting clients go first, the lowest pass (served less by weight) first
+        for(auto &it : _fair_order) {
+            n = it.second;
+            if(!n.empty() && n.ptr()[0] == '/') n.remove(1);
+            QueueLine *ql = server->get_queue(n, true);
+            it.first = ql->queued ? ql->pass.load() : UINT64_MAX;
         }
+        std::stable_sort(_fair_order.begin(), _fair_order.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
     }
-    if(start < name.size()) {
-        n.set(&ptr[start], i - start);
-        _add_worker(n, worker);
+
+    for(auto &it : _fair_order) {
+        if(_add_worker(it.second, worker) == 1) {
+            // worker is taken
+            return;
+        }
     }
 }
 
@@ -373,6 +860,14 @@ int Loop::_add_worker(Slice name, Connect *worker) {
     std::string sid;
 
     ql->mutex.lock();
+    if(worker->has_limits) {
+        ql->limits = worker->limits;
+        ql->coalesce = ql->limits.coalesce;
+        ql->cache_ttl = ql->limits.cache;
+    }
+    if(ql->limits.durable) ql->durable = true;
+    if(ql->limits.cache) ql->cacheable = true;
+    if(worker->weight) ql->weight = worker->weight;
     int rloop = _nloop;
     for(int index=-1;index<server->threads;index++) {
         if(index == _nloop) continue;
@@ -380,12 +875,14 @@ int Loop::_add_worker(Slice name, Connect *worker) {
         q = &ql->queue[rloop];
 
         while(q->clients.size()) {
-            client = q->clients.front();
-            q->clients.pop_front();
+            client = q->clients.pop();
+            client->wait_queue = NULL;
+            ql->queued--;
+            ql->queued_bytes -= client->wait_bytes;
             client->unlink();
 
             if(client->is_closed()) {
-                if(server->log & 8) std::cout << ltime() << "closed client " << client << std::endl;
+                if(server->log & 8) Log(8) << "closed client " << client;
                 client = NULL;
                 continue;
             }
@@ -401,36 +898,38 @@ int Loop::_add_worker(Slice name, Connect *worker) {
             }
 
             if(skip) {
-                if(server->log & 8) std::cout << ltime() << "client is busy!!! " << client << std::endl;
+                if(server->log & 8) Log(8) << "client is busy!!! " << client;
                 client = NULL;
                 continue;
             }
 
-            if(worker->noid) break;
-            Slice id = client->id;
-            if(id.empty()) {
-                while(client->json.scan()) {
-                    if(client->json.key == "id") {
-                        id = client->json.value;
-                        client->id.set(id);
-                        break;
-                    }
-                }
-                if(id.empty()) {
-                    client->gen_id();
-                    id = client->id;
-                };
+            if(client->deadline && client->deadline <= now) {
+                // client has given up, don't waste the worker
+                ql->shed++;
+                inc(ql->metrics[_nloop].shed);
+                inc(ql->metrics[_nloop].errors_5xx);
+                if(server->log & 4) Log(4) << "504 deadline " << name;
+                client->send.status("504 Gateway Timeout")->done(-1);
+                client->status = Status::net;
+                client->release_job();
+                client = NULL;
+                continue;
             }
-            sid = id.as_string();
+
+            if(worker->noid) break;
+            sid = client->get_id().as_string();
 
             server->wait_lock.lock();
             bool busy = server->wait_response.find(sid) != server->wait_response.end();
             server->wait_lock.unlock();
             if(busy) {
                 // colision id
-                if(server->log & 2) std::cout << ltime() << "collision id\n";
+                if(server->log & 2) Log(2) << "collision id";
+                inc(ql->metrics[_nloop].errors_4xx);
                 client->send.status("400 Collision Id")->done(-1);  // FIXME
                 client->status = Status::net;
+                client->release_job();
+                if(client->detached) _job_end(client, true);
                 client = NULL;
                 continue;
             }
@@ -440,15 +939,18 @@ int Loop::_add_worker(Slice name, Connect *worker) {
     }
 
     if(client) {
+        u64 pass = ql->pass + FAIR_STRIDE / ql->weight;
+        ql->pass = pass;
+        if(pass > server->fair_pass) server->fair_pass = pass;
         if(worker->fail_on_disconnect) {
             worker->client = client;
             worker->client->link();
         }
         if(worker->noid) {
             worker->status = Status::worker_wait_result;
-            worker->send.status("200 OK")->header("Name", name)->autosend(false)->done(client->body);
+            _send_task(worker, client, ql, name, NULL);
         } else {
-            worker->send.status("200 OK")->header("Id", client->id)->header("Name", name)->autosend(false)->done(client->body);
+            _send_task(worker, client, ql, name, &client->id);
             server->wait_lock.lock();
             server->wait_response[sid] = client;
             server->wait_lock.unlock();
@@ -474,11 +976,13 @@ int Loop::_add_worker(Slice name, Connect *worker) {
         q0->workers.push_back(worker);
         worker->link();
         worker->status = Status::worker_wait_job;
+        worker->wait_since = now;
         result = 0;
     }
 
     ql->mutex.unlock();
 
+    if(!result && server->worker_timeout) set_timer(worker, now + server->worker_timeout);
     if(client && client->send_buffer.size()) {
         client->write_mode(true);
     }
@@ -489,17 +993,73 @@ int Loop::_add_worker(Slice name, Connect *worker) {
 };
 
 int Loop::client_request(ISlice name, Connect *client) {
+    if(!client->detached) {
+        // a job is counted as the call of its client
+        requests++;
+        if(capture) capture->add(CAPTURE_REQUEST, name, client->id, client->body, get_time_us());
+    }
     QueueLine *ql = server->get_queue(name);
+    if(!ql && wal && server->is_durable(name)) ql = server->get_queue(name, true);  // jobs wait for a worker
+    if(!ql && server->peers.size() && !client->detached && server->remote_idle(name)) ql = server->get_queue(name, true);  // workers of other nodes
     if(!ql) {
-        if(server->log & 4) std::cout << ltime() << "404 no method " << name.as_string() << std::endl;
+        if(server->log & 4) Log(4) << "404 no method " << name;
         client->send.status("404 Not Found")->done(-32601);
         return -1;
     }
+    if(!client->detached && (client->async || (ql->durable && wal))) return _submit_job(ql, client);
+    MethodMetrics &mm = ql->metrics[_nloop];
+    inc(mm.requests);
+    if(client->broadcast_need && !client->detached) return _broadcast(ql, client);
+    if(server->cache && ql->cacheable && !client->detached) {
+        Slice key = client->get_key();
+        client->cache_hash = ResultCache::hash(ql->name, key);
+        if(server->cache->get(client->cache_hash, ql->name, key, now, _cache_result)) {
+            inc(mm.cache_hits);
+            Slice id = client->get_id();
+            client->send.status("200 OK")->header("Id", id)->done(_cache_result);
+            return 0;
+        }
+        inc(mm.cache_misses);
+    }
+    if(traces && ++_trace_count >= server->trace_rate) {
+        _trace_count = 0;
+        client->trace = true;
+        client->trace_queue = ql;
+    }
+    // metrics use the time of the iteration, only a sampled request reads the clock
+    client->request_us = client->trace ? get_time_us() : now_us;
+
+    if(client->deadline && client->deadline <= now) {
+        ql->mutex.lock();
+        ql->shed++;
+        ql->mutex.unlock();
+        inc(mm.shed);
+        inc(mm.errors_5xx);
+        if(server->log & 4) Log(4) << "504 deadline " << name;
+        client->send.status("504 Gateway Timeout")->done(-1);
+        return -4;
+    }
+
+    if(ql->coalesce && !client->detached && server->coalesce(ql, client)) {
+        inc(mm.coalesced);
+        client->trace = false;
+        return 0;
+    }
 
     Connect *worker = NULL;
     Queue *q;
 
     ql->mutex.lock();
+    if(ql->limits.inflight && ql->inflight >= ql->limits.inflight) {
+        ql->rejected++;
+        ql->mutex.unlock();
+        inc(mm.errors_5xx);
+        if(server->log & 4) Log(4) << "503 inflight limit " << name;
+        client->send.status("503 Service Unavailable")->done(-1);
+        if(client->coalesce_leader) server->coalesce_done(client, NULL);
+        return -5;
+    }
+
     int rloop = _nloop;
     for(int index=-1;index<server->threads;index++) {
         if(index == _nloop) continue;
@@ -512,7 +1072,7 @@ int Loop::client_request(ISlice name, Connect *client) {
             worker->unlink();
 
             if(worker->is_closed()) {
-                if(server->log & 8) std::cout << ltime() << "worker closed " << worker << std::endl;
+                if(server->log & 8) Log(8) << "worker closed " << worker;
                 worker = NULL;
                 continue;
             }
@@ -528,7 +1088,7 @@ int Loop::client_request(ISlice name, Connect *client) {
             }
 
             if(busy) {
-                if(server->log & 8) std::cout << "worker is not ready " << worker << std::endl;
+                if(server->log & 8) Log(8) << "worker is not ready " << worker;
                 worker = NULL;
                 continue;
             }
@@ -543,22 +1103,9 @@ int Loop::client_request(ISlice name, Connect *client) {
             worker->client = client;
             client->link();
             worker->status = Status::worker_wait_result;
-            worker->send.status("200 OK")->header("Name", name)->autosend(false)->done(client->body);
+            _send_task(worker, client, ql, name, NULL);
         } else {
-            Slice id(client->id);
-            if(id.empty()) {
-                while(client->json.scan()) {
-                    if(client->json.key == "id") {
-                        id = client->json.value;
-                        client->id.set(client->json.value);
-                        break;
-                    }
-                }
-            }
-            if(id.empty()) {
-                client->gen_id();
-                id.set(client->id);
-            }
+            Slice id = client->get_id();
             std::string sid = id.as_string();
 
             server->wait_lock.lock();
@@ -569,36 +1116,75 @@ int Loop::client_request(ISlice name, Connect *client) {
                 worker->status = Status::worker_wait_job;
                 ql->queue[worker->nloop].workers.push_front(worker);
                 ql->mutex.unlock();
+                inc(mm.errors_4xx);
                 client->send.status("400 Collision Id")->done(-1);
-                if(server->log & 4) std::cout << ltime() << "400 collision id " << name.as_string() << std::endl;
+                if(server->log & 4) Log(4) << "400 collision id " << name;
+                if(client->coalesce_leader) server->coalesce_done(client, NULL);
                 return -3;
             }
             if(worker->fail_on_disconnect) {
                 worker->client = client;
                 client->link();
             }
-            worker->send.status("200 OK")->header("Id", id)->header("Name", name)->autosend(false)->done(client->body);
+            _send_task(worker, client, ql, name, &id);
             server->wait_lock.lock();
             server->wait_response[sid] = client;
             server->wait_lock.unlock();
             client->link();
             worker->status = Status::net;
         }
-    } else {
-        bool inserted = false;
-        auto *clients = &ql->queue[_nloop].clients;
-        for(auto it=clients->crbegin(); it!=clients->crend(); it++) {
-            if(client->priority <= (*it)->priority) {
-                clients->insert(it.base(), client);
-                inserted = true;
-                break;
+    }
+
+    if(!worker && server->peers.size() && !client->detached) {
+        Peer *peer = server->pick_peer(ql->name);
+        if(peer) {
+            ql->mutex.unlock();
+            return _forward(peer, ql, client);
+        }
+    }
+
+    Connect *dropped = NULL;
+    if(!worker) {
+        QueueLimits &limits = ql->limits;
+        while((limits.queue && ql->queued >= limits.queue) || (limits.bytes && ql->queued && ql->queued_bytes + client->body.size() > limits.bytes)) {
+            if(limits.drop_oldest) dropped = _pop_oldest(ql, client);
+            if(!dropped) {
+                ql->rejected++;
+                ql->mutex.unlock();
+                inc(mm.errors_4xx);
+                if(server->log & 4) Log(4) << "429 queue is full " << name;
+                client->send.status("429 Too Many Requests")->done(-1);
+                if(client->coalesce_leader) server->coalesce_done(client, NULL);
+                return -6;
             }
+            ql->rejected++;
+            inc(mm.errors_5xx);
+            if(server->log & 4) Log(4) << "503 dropped from queue " << name;
+            dropped->send.status("503 Service Unavailable")->done(-1);
+            dropped->release_job();
+            if(dropped->detached) _job_end(dropped, true);  // dropped by the policy
+            dropped->unlink();
+            dropped = NULL;
+        }
+
+        if(!ql->queued) {
+            // an idle method doesn't save up a share
+            u64 pass = server->fair_pass;
+            if(ql->pass < pass) ql->pass = pass;
         }
-        if(!inserted) clients->push_front(client);
+        ql->queue[_nloop].clients.push(client);
         client->link();
+        client->wait_queue = ql;
+        client->wait_loop = _nloop;
+        client->wait_since = now;
+        client->wait_bytes = client->body.size();
+        ql->queued++;
+        ql->queued_bytes += client->wait_bytes;
     };
 
     client->status = Status::client_wait_result;
+    client->job_queue = ql;
+    ql->inflight++;
     ql->mutex.unlock();
 
     if(worker && worker->send_buffer.size()) {
@@ -607,6 +1193,10 @@ int Loop::client_request(ISlice name, Connect *client) {
     if(client->send_buffer.size()) {
         client->write_mode(true);
     }
+    if(!worker) {
+        long deadline = client->get_deadline();
+        if(deadline) set_timer(client, deadline);
+    }
 
     return 0;
 };
@@ -618,17 +1208,48 @@ int Loop::worker_result(ISlice id, Connect *worker) {
     server->wait_lock.lock();
     server->wait_response.erase(it);
     server->wait_lock.unlock();
+    _count_result(client, worker);
+    client->release_job();
 
     client->unlink();
+    if(client->broadcast) {
+        _broadcast_result(client, worker);
+        return 0;
+    }
     if(client->is_closed()) return -2;
     if(worker) client->send.status("200 OK")->header("Id", id)->done(worker->body);
     else client->send.status("503 Service Unavailable")->header("Id", id)->done(-1);
     client->status = Status::net;
 
     if(worker && worker->nloop != worker->need_loop) migrate(worker, client);
+    if(client->detached) _job_end(client, worker != NULL, worker ? &worker->body : NULL);
     return 0;
 };
 
+void Loop::_count_result(Connect *client, Connect *worker) {
+    // worker is NULL if it has gone
+    if(client->trace) client->result_us = get_time_us();
+    QueueLine *ql = client->job_queue;
+    if(!ql) return;
+    if(capture && worker) capture->add(CAPTURE_RESULT, ql->name, client->id, worker->body, get_time_us());
+    MethodMetrics &mm = ql->metrics[_nloop];
+    if(worker) {
+        inc(mm.results);
+        mm.service.add(now_us - client->task_us);
+    } else inc(mm.errors_5xx);
+
+    if(client->coalesce_leader) server->coalesce_done(client, worker);
+    if(worker && server->cache) {
+        // Cache header of a result overrides ttl of the method
+        int ttl = worker->cache_ttl >= 0 ? worker->cache_ttl : ql->cache_ttl.load();
+        if(ttl > 0) {
+            if(!ql->cacheable) ql->cacheable = true;
+            Slice key = client->get_key();
+            if(!client->cache_hash) client->cache_hash = ResultCache::hash(ql->name, key);
+            server->cache->put(client->cache_hash, ql->name, key, worker->body, now + ttl);
+        }
+    }
+}
 int Loop::worker_result_noid(Connect *worker) {
     auto client = worker->client;
     if(!client) THROW("No connected client for noid");
@@ -638,32 +1259,61 @@ int Loop::worker_result_noid(Connect *worker) {
         worker->fail_on_disconnect = false;
     }
     worker->client = NULL;
+    _count_result(client, worker);
+    client->release_job();
     client->unlink();
+    if(client->broadcast) {
+        _broadcast_result(client, worker);
+        return 0;
+    }
 
     if(client->is_closed()) return -2;
     client->status = Status::net;
     client->send.status("200 OK")->done(worker->body);
 
     if(worker->nloop != worker->need_loop) migrate(worker, client);
+    if(client->detached) _job_end(client, true, &worker->body);
     return 0;
 };
 
 void Loop::on_disconnect(Connect *conn) {
+    if(conn->fetch_wait && server->results->cancel(conn->id, conn)) {
+        conn->fetch_wait = false;
+        conn->unlink();
+    }
     if(conn->status == Status::client_wait_result && !conn->id.empty()) {
         auto it = server->wait_response.find(conn->id.as_string());
-        if(it != server->wait_response.end()) {
+        if(it != server->wait_response.end() && it->second == conn) {
             server->wait_lock.lock();
             server->wait_response.erase(it);
             server->wait_lock.unlock();
             conn->unlink();
         }
     };
+    if(conn->jobs.size()) {
+        // jobs without results are queued again, with or without fail_on_disconnect
+        std::vector<std::pair<std::string, Connect*>> jobs;
+        conn->mutex.lock();
+        jobs.swap(conn->jobs);
+        conn->mutex.unlock();
+        for(auto &it : jobs) {
+            server->wait_lock.lock();
+            auto found = server->wait_response.find(it.first);
+            bool held = found != server->wait_response.end() && found->second == it.second;
+            server->wait_lock.unlock();
+            if(held) worker_result(Slice(it.first.data(), it.first.size()), NULL);
+        }
+    }
     if(!conn->fail_on_disconnect) return;
     if(conn->noid) {
         if(conn->status == Status::worker_wait_result) {
-            if(!conn->client) THROW("No client");
-            if(!conn->client->is_closed()) conn->client->send.status("503 Service Unavailable")->done(-1);
-            conn->client->status = Status::net;
+            if(conn->client) {  // no client after worker timeout
+                conn->client->release_job();
+                if(!conn->client->is_closed()) conn->client->send.status("503 Service Unavailable")->done(-1);
+                conn->client->status = Status::net;
+                if(conn->client->broadcast) _broadcast_result(conn->client, NULL);
+                else if(conn->client->detached) _job_end(conn->client, false);
+            }
         } else if(conn->client) THROW("Client is linked to pending worker");
     } else if(conn->client) {
         worker_result(conn->client->id, NULL);
@@ -674,11 +1324,591 @@ void Loop::on_disconnect(Connect *conn) {
     };
 };
 
+bool Loop::_drop_client(Connect *client, bool shed) {
+    // remove a waiting client from its queue, shed - by its deadline
+    QueueLine *ql = client->wait_queue;
+    if(!ql) return false;
+    ql->mutex.lock();
+    bool queued = client->wait_queue == ql && client->status == Status::client_wait_result;
+    if(queued) {
+        ql->queue[client->wait_loop].clients.remove(client);
+        ql->queued--;
+        ql->queued_bytes -= client->wait_bytes;
+        client->unlink();
+        client->wait_queue = NULL;
+        client->status = Status::net;
+        client->release_job();
+        if(shed) {
+            ql->shed++;
+            inc(ql->metrics[_nloop].shed);
+            inc(ql->metrics[_nloop].errors_5xx);
+        }
+    }
+    ql->mutex.unlock();
+    return queued;
+}
+
+Connect *Loop::_pop_oldest(QueueLine *ql, Connect *client) {
+    // under ql->mutex, returns a linked waiting client: the oldest of the lowest priority of all loops,
+    // NULL if every waiting client has a higher priority than the new one
+    int max_level = ClientQueue::level(client->priority);
+    while(true) {
+        Connect *oldest = NULL;
+        ClientQueue *queue = NULL;
+        for(int i=0;i<server->threads;i++) {
+            ClientQueue &clients = ql->queue[i].clients;
+            Connect *c = clients.lowest();
+            if(!c || c->wait_level > max_level) continue;
+            if(!oldest || c->wait_level < oldest->wait_level || (c->wait_level == oldest->wait_level && c->wait_since < oldest->wait_since)) {
+                oldest = c;
+                queue = &clients;
+            }
+        }
+        if(!oldest) return NULL;
+
+        queue->remove(oldest);
+        oldest->wait_queue = NULL;
+        ql->queued--;
+        ql->queued_bytes -= oldest->wait_bytes;
+
+        bool waiting = false;
+        if(!oldest->is_closed() && oldest->status == Status::client_wait_result) {
+            oldest->mutex.lock();
+            if(oldest->status == Status::client_wait_result) {
+                oldest->status = Status::net;
+                waiting = true;
+            }
+            oldest->mutex.unlock();
+        }
+        if(waiting) return oldest;
+        oldest->unlink();
+    }
+}
+
+void Loop::_on_timer(Connect *conn) {
+    if(conn->is_closed() || conn->nloop != _nloop) return;
+    long expire = 0;
+
+    long deadline = conn->get_deadline();
+    if(conn->status == Status::client_wait_result && conn->wait_queue && deadline) {
+        if(deadline > now) expire = deadline;
+        else if(_drop_client(conn)) {
+            if(server->log & 4) Log(4) << "504 client timeout " << (void*)conn;
+            conn->send.status("504 Gateway Timeout")->done(-1);
+        }
+    } else if(conn->status == Status::client_wait_result && conn->broadcast) {
+        if(conn->deadline > now) expire = conn->deadline;
+        else if(conn->deadline) {
+            // a reply with results so far
+            Broadcast *b = NULL;
+            conn->mutex.lock();
+            if(conn->broadcast) {
+                conn->broadcast->mutex.lock();
+                if(!conn->broadcast->done) {
+                    conn->broadcast->done = true;
+                    b = conn->broadcast;
+                }
+                conn->broadcast->mutex.unlock();
+            }
+            conn->mutex.unlock();
+            if(b) _broadcast_reply(b, true);
+        }
+    } else if(conn->status == Status::client_wait_result && conn->forwarded && deadline) {
+        if(deadline > now) expire = deadline;
+        else {
+            // the peer is connected but has not answered
+            std::string sid = conn->id.as_string();
+            bool waiting = false;
+            server->wait_lock.lock();
+            auto it = server->wait_response.find(sid);
+            if(it != server->wait_response.end() && it->second == conn) {
+                server->wait_response.erase(it);
+                waiting = true;
+            }
+            server->wait_lock.unlock();
+            if(waiting) {
+                conn->forwarded->call_done(conn->id);
+                QueueLine *ql = conn->job_queue;
+                if(ql) inc(ql->metrics[_nloop].errors_5xx);
+                conn->release_job();
+                conn->status = Status::net;
+                if(server->log & 4) Log(4) << "504 peer timeout " << (void*)conn;
+                conn->send.status("504 Gateway Timeout")->done(-1);
+                conn->unlink();
+            }
+        }
+    } else if(conn->status == Status::client_wait_result && conn->fetch_wait) {
+        if(conn->deadline > now) expire = conn->deadline;
+        else if(server->results->cancel(conn->id, conn)) {
+            // still pending
+            conn->fetch_wait = false;
+            conn->status = Status::net;
+            conn->send.status("202 Accepted")->header("Id", conn->id)->done();
+            conn->unlink();
+        }
+    } else if(conn->status == Status::worker_wait_job && server->worker_timeout) {
+        deadline = conn->wait_since + server->worker_timeout;
+        if(deadline > now) expire = deadline;
+        else {
+            bool expired = false;
+            conn->mutex.lock();
+            if(conn->status == Status::worker_wait_job) {
+                // worker mode keeps waiting for a result, so the next post is accepted
+                conn->status = conn->worker_mode ? Status::worker_wait_result : Status::net;
+                expired = true;
+            }
+            conn->mutex.unlock();
+            if(expired) {
+                if(server->log & 8) Log(8) << "204 worker timeout " << (void*)conn;
+                conn->send.status("204 No Content")->done();
+            }
+        }
+    }
+
+    if(server->idle_timeout) {
+        deadline = conn->active + server->idle_timeout;
+        if(deadline <= now) {
+            if(conn->status == Status::net && conn->send_buffer.size() == 0 && !conn->has_task) {
+                if(server->log & 16) Log(16) << "idle timeout " << conn->fd << " " << (void*)conn;
+                _close(conn->fd);
+                return;
+            }
+            deadline = now + server->idle_timeout;
+        }
+        if(!expire || deadline < expire) expire = deadline;
+    }
+
+    if(expire) set_timer(conn, expire);
+}
+
+void Loop::_send_task(Connect *worker, Connect *client, QueueLine *ql, ISlice &name, ISlice *id) {
+    client->task_us = client->trace ? get_time_us() : now_us;
+    // the client could be queued by another loop, whose iteration started later
+    u64 wait = client->task_us > client->request_us ? client->task_us - client->request_us : 0;
+    ql->metrics[_nloop].wait.add(wait);
+    worker->send.status("200 OK");
+    if(id) worker->send.header("Id", *id);
+    worker->send.header("Name", name);
+    if(client->deadline) {
+        // remaining budget, ms
+        long left = client->deadline - now;
+        worker->send.header("Timeout", left > 0 ? left : 0);
+    }
+    if(client->broadcast) worker->send.autosend(false)->done(client->broadcast->body);
+    else worker->send.autosend(false)->done(client->body);
+    if(id) worker->has_task = true;
+    if(id && client->detached && !client->broadcast) _hold_job(worker, client);
+}
+
+void Loop::_hold_job(Connect *worker, Connect *job) {
+    // a job of an id worker is queued again if the worker is lost, see on_disconnect
+    LOCK _l(worker->mutex);
+    auto &jobs = worker->jobs;
+    if(jobs.size() >= 16) {
+        // forget jobs with results
+        LOCK _w(server->wait_lock);
+        jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [this](const std::pair<std::string, Connect*> &it) {
+            auto found = server->wait_response.find(it.first);
+            return found == server->wait_response.end() || found->second != it.second;
+        }), jobs.end());
+    }
+    jobs.push_back({job->id.as_string(), job});
+}
+
 void Loop::migrate(Connect *w, Connect *c) {
-    if(_nloop == w->need_loop && server->log & 1) std::cout << "migrate warning: connection is on target loop\n";
+    if(_nloop == w->need_loop && server->log & 1) Log(1) << "migrate warning: connection is on target loop";
 
     w->go_loop = true;
     c->go_loop = true;
     c->need_loop = w->need_loop;
-    if(server->log & 64) std::cout << "migrate: loop " << _nloop << " -> " << w->need_loop << ", fd " << w->fd << ", " << c->fd << std::endl;
+    if(server->log & 64) Log(64) << "migrate: loop " << _nloop << " -> " << w->need_loop << ", fd " << w->fd << ", " << c->fd;
 };
+
+
+/* durable jobs */
+
+Connect *Loop::_new_job(ISlice &name, ISlice &body, int priority) {
+    // a client without a socket, the base link is released by _job_end
+    Connect *job = new Connect(server, -1);
+    job->loop = this;
+    job->nloop = job->need_loop = _nloop;
+    job->detached = true;
+    job->keep_alive = false;
+    job->fail_on_disconnect = false;
+    job->noid = false;
+    job->priority = priority;
+    job->name.set(name);
+    job->body.set(body);
+    job->link();
+    return job;
+}
+
+int Loop::_submit_job(QueueLine *ql, Connect *client) {
+    // the client gets 202 with the job id, after a sync of the log for a durable method
+    bool durable = ql->durable && wal;
+    if(durable && client->body.size() > WAL_MAX_BODY) {
+        client->send.status("413 Payload Too Large")->done(-1);
+        return -7;
+    }
+    Connect *job = _new_job(ql->name, client->body, client->priority);
+    job->gen_id();
+    if(!server->results->add(job->id)) {
+        inc(ql->metrics[_nloop].errors_5xx);
+        if(server->log & 4) Log(4) << "503 result store is full " << ql->name;
+        client->send.status("503 Service Unavailable")->done(-1);
+        job->unlink();
+        return -5;
+    }
+    std::string id = job->id.as_string();  // the job can be done and deleted by another loop
+    // logged before it's queued, so a result is never written before its job
+    if(durable) wal->add_job(job->id, ql->name, job->body, job->priority);
+    int r = client_request(ql->name, job);
+    if(r < 0) {
+        if(durable) wal->done(job->id);
+        _store_result(job->id, NULL);
+        client->send.status(r == -6 ? "429 Too Many Requests" : "503 Service Unavailable")->done(-1);
+        job->unlink();
+        return r;
+    }
+    if(durable) {
+        client->status = Status::client_wait_result;
+        client->link();
+        _wal_acks.push_back({client, id});
+    } else {
+        Slice sid(id.data(), id.size());
+        client->send.status("202 Accepted")->header("Id", sid)->done();
+    }
+    return 0;
+}
+
+void Loop::_job_end(Connect *job, bool done, ISlice *result) {
+    // a job without a result is queued again, so delivery is at least once
+    if(job->peer) {
+        // forwarded by another node, it decides what to do with a failed call
+        job->peer->send_result(job->peer_id, done ? result : NULL);
+        job->loop = this;
+        job->unlink();
+        return;
+    }
+    if(!done && ++job->attempts >= JOB_MAX_ATTEMPTS) {
+        if(server->log & 4) Log(4) << "job failed, lost workers: " << job->attempts << " " << job->name;
+        done = true;  // without a result, fetch gets 503
+    }
+    if(done) {
+        Wal *home = server->loops[job->nloop]->wal;
+        if(home) home->done(job->id);
+        _store_result(job->id, result);
+        job->loop = this;
+        job->unlink();
+        return;
+    }
+    job->send_buffer.clear();
+    job->status = Status::net;
+    if(client_request(job->name, job) < 0) {
+        job->retry_until = now + JOB_RETRY_MS;
+        _requeue.push_back(job);
+    }
+}
+
+void Loop::_retry_jobs() {
+    // restored jobs and jobs over limits of the method
+    std::vector<Connect*> jobs;
+    jobs.swap(_requeue);
+    for(Connect *job : jobs) {
+        if(!job->retry_until) job->retry_until = now + JOB_RETRY_MS;  // restored before the loop is started
+        else if(now >= job->retry_until) {
+            if(server->log & 4) Log(4) << "job failed, not queued for " << JOB_RETRY_MS << "ms " << job->name;
+            _job_end(job, true);
+            continue;
+        }
+        job->send_buffer.clear();
+        job->status = Status::net;
+        if(client_request(job->name, job) < 0) _requeue.push_back(job);
+        else job->retry_until = 0;
+    }
+    _requeue_at = now + 100;
+}
+
+void Loop::_wal_commit() {
+    // group commit, one sync for jobs of all clients since the last one
+    wal->sync();
+    inc(metrics.wal_syncs);
+    inc(metrics.wal_acks, _wal_acks.size());
+    for(auto &it : _wal_acks) {
+        Connect *client = it.first;
+        if(!client->is_closed()) {
+            Slice id(it.second.data(), it.second.size());
+            client->status = Status::net;
+            client->send.status("202 Accepted")->header("Id", id)->done();
+        }
+        client->unlink();
+    }
+    _wal_acks.clear();
+    _wal_sync_at = now + server->wal_sync;
+}
+
+void Loop::_store_result(ISlice &id, ISlice *result) {
+    // NULL for a failed job, long-polling clients get the result
+    server->results->put(id, result, now + server->results_ttl, now, _store_waiters);
+    for(Connect *client : _store_waiters) {
+        if(!client->is_closed()) {
+            client->fetch_wait = false;
+            client->status = Status::net;
+            if(result) client->send.status("200 OK")->header("Id", id)->done(*result);
+            else client->send.status("503 Service Unavailable")->header("Id", id)->done(-1);
+        }
+        client->unlink();
+    }
+    _store_waiters.clear();
+}
+
+void Loop::fetch_result(Connect *client) {
+    // result of an async call, a pending one is waited for up to the Timeout of the client
+    bool wait = client->deadline > now;
+    if(wait) {
+        // a result can come from another loop as soon as the client is in the store
+        client->fetch_wait = true;
+        client->status = Status::client_wait_result;
+        client->link();
+    }
+    int r = server->results->fetch(client->id, wait ? client : NULL, now, _fetch_result);
+    if(r == STORE_PENDING && wait) {
+        set_timer(client, client->deadline);
+        return;
+    }
+    if(wait) {
+        client->fetch_wait = false;
+        client->status = Status::net;
+        client->unlink();
+    }
+    if(r == STORE_DONE) client->send.status("200 OK")->header("Id", client->id)->done(_fetch_result);
+    else if(r == STORE_FAILED) client->send.status("503 Service Unavailable")->header("Id", client->id)->done(-1);
+    else if(r == STORE_PENDING) client->send.status("202 Accepted")->header("Id", client->id)->done();
+    else client->send.status("404 Not Found")->done(-1);
+}
+
+void Loop::restore_job(WalJob &item) {
+    // from the log of the last run, before the loop is started
+    Slice name(item.method.data(), item.method.size());
+    Slice body(item.body.data(), item.body.size());
+    QueueLine *ql = server->get_queue(name, true);
+    ql->durable = true;
+    Connect *job = _new_job(name, body, item.priority);
+    job->id.set(item.id.data(), item.id.size());
+    wal->add_job(job->id, ql->name, job->body, job->priority);
+    server->results->add(job->id, true);  // logged jobs are kept over the size
+    _requeue.push_back(job);
+}
+
+
+/* broadcast */
+
+int Loop::_broadcast(QueueLine *ql, Connect *client) {
+    // the body goes to every waiting worker of the method, the client waits for broadcast_need results
+    MethodMetrics &mm = ql->metrics[_nloop];
+    client->request_us = now_us;
+    std::vector<Connect*> workers;
+
+    ql->mutex.lock();
+    for(int n=0;n<server->threads;n++) {
+        Queue *q = &ql->queue[n];
+        while(q->workers.size()) {
+            Connect *worker = q->workers.front();
+            q->workers.pop_front();
+            worker->unlink();
+            if(worker->is_closed()) continue;
+
+            bool busy = true;
+            if(worker->status == Status::worker_wait_job) {
+                worker->mutex.lock();
+                if(worker->status == Status::worker_wait_job) {
+                    worker->status = Status::busy;
+                    busy = false;
+                }
+                worker->mutex.unlock();
+            }
+            if(!busy) workers.push_back(worker);
+        }
+    }
+    ql->mutex.unlock();
+
+    if(workers.empty()) {
+        inc(mm.errors_5xx);
+        if(server->log & 4) Log(4) << "503 no workers for broadcast " << ql->name;
+        client->send.status("503 Service Unavailable")->done(-1);
+        return -5;
+    }
+
+    int count = workers.size();
+    Broadcast *b = new Broadcast();
+    b->client = client;
+    b->body = std::make_shared<Buffer>();
+    b->body->set(client->body);
+    b->delivered = b->pending = count;
+    b->need = client->broadcast_need < 0 || client->broadcast_need > count ? count : client->broadcast_need;
+    b->refs = count + 1;
+    if(b->need > 1) b->result.add("[");
+    client->broadcast = b;
+    client->status = Status::client_wait_result;
+    client->link();
+    if(!client->deadline && server->client_timeout) client->deadline = now + server->client_timeout;
+    inc(mm.broadcasts);
+    inc(mm.broadcast_deliveries, count);
+
+    Slice none("");
+    for(Connect *worker : workers) {
+        // a part is a client without a body for one worker
+        Connect *part = _new_job(ql->name, none, client->priority);
+        part->broadcast = b;
+        part->deadline = client->deadline;
+        part->request_us = client->request_us;
+        if(worker->noid) {
+            worker->client = part;
+            part->link();
+            worker->status = Status::worker_wait_result;
+            _send_task(worker, part, ql, ql->name, NULL);
+        } else {
+            part->gen_id();
+            Slice id(part->id);
+            _send_task(worker, part, ql, ql->name, &id);
+            server->wait_lock.lock();
+            server->wait_response[id.as_string()] = part;
+            server->wait_lock.unlock();
+            part->link();
+            if(worker->fail_on_disconnect) {
+                worker->client = part;
+                part->link();
+            }
+            worker->status = Status::net;
+        }
+        worker->write_mode(true);
+    }
+
+    if(client->deadline) set_timer(client, client->deadline);
+    return 0;
+}
+
+void Loop::_broadcast_result(Connect *part, Connect *worker) {
+    // worker is NULL if it has gone
+    Broadcast *b = part->broadcast;
+    bool reply = false;
+    b->mutex.lock();
+    b->pending--;
+    if(worker && !b->done) {
+        if(b->need == 1) b->result.set(worker->body);
+        else {
+            if(b->results) b->result.add(", ");
+            if(worker->body.size()) b->result.add(worker->body);
+            else b->result.add("null");
+        }
+        b->results++;
+    }
+    if(!b->done && (b->results >= b->need || !b->pending)) reply = b->done = true;
+    b->mutex.unlock();
+
+    if(reply) _broadcast_reply(b, false);
+    part->loop = this;
+    part->unlink();
+    _broadcast_unref(b);
+}
+
+void Loop::_broadcast_reply(Broadcast *b, bool timeout) {
+    // once, by the one who has set b->done
+    Connect *client = b->client;
+    if(!client->is_closed()) {
+        if(b->results >= b->need) {
+            if(b->need > 1) b->result.add("]");
+            client->send.status("200 OK")->header("Delivered", b->delivered)->done(b->result);
+        } else if(timeout) {
+            if(server->log & 4) Log(4) << "504 broadcast timeout";
+            client->send.status("504 Gateway Timeout")->header("Delivered", b->delivered)->done(-1);
+        } else {
+            if(server->log & 4) Log(4) << "503 broadcast failed";
+            client->send.status("503 Service Unavailable")->header("Delivered", b->delivered)->done(-1);
+        }
+    }
+    client->status = Status::net;
+    client->mutex.lock();
+    client->broadcast = NULL;
+    client->mutex.unlock();
+    client->unlink();
+    _broadcast_unref(b);
+}
+
+void Loop::_broadcast_unref(Broadcast *b) {
+    b->mutex.lock();
+    bool last = --b->refs == 0;
+    b->mutex.unlock();
+    if(last) delete b;
+}
+
+
+/* nodes */
+
+int Loop::_forward(Peer *peer, QueueLine *ql, Connect *client) {
+    // no idle worker here, the result comes back by the id from the link of the peer
+    MethodMetrics &mm = ql->metrics[_nloop];
+    Slice id = client->get_id();
+    std::string sid = id.as_string();
+    server->wait_lock.lock();
+    bool busy = server->wait_response.find(sid) != server->wait_response.end();
+    if(!busy) server->wait_response[sid] = client;
+    server->wait_lock.unlock();
+    if(busy) {
+        inc(mm.errors_4xx);
+        client->send.status("400 Collision Id")->done(-1);
+        if(server->log & 4) Log(4) << "400 collision id " << ql->name;
+        if(client->coalesce_leader) server->coalesce_done(client, NULL);
+        return -3;
+    }
+    client->link();
+    client->status = Status::client_wait_result;
+    client->job_queue = ql;
+    client->forwarded = peer;
+    client->wait_since = now;
+    ql->inflight++;
+    client->task_us = now_us;
+    inc(mm.forwarded);
+    long timeout = 0;
+    if(client->deadline) timeout = client->deadline > now ? client->deadline - now : 1;
+    peer->send_call(id, ql->name, client->body, client->priority, timeout);
+    long deadline = client->get_deadline();
+    if(deadline) set_timer(client, deadline);
+    return 0;
+}
+
+void Loop::_peer_failed() {
+    // calls forwarded over a lost link
+    std::vector<std::string> failed;
+    server->peer_lock.lock();
+    failed.swap(server->peer_failed);
+    server->peer_lock.unlock();
+    for(auto &id : failed) worker_result(Slice(id.data(), id.size()), NULL);
+}
+
+void Loop::peer_message(Connect *conn, ISlice &method, bool failed) {
+    // from a link of another node, nothing is sent back on it
+    Peer *peer = server->find_peer(conn->peer_name);
+    if(!peer) {
+        // the node fails its calls when the link is closed
+        if(server->log & 2) Log(2) << "message of unknown peer " << conn->peer_name;
+        conn->close();
+        return;
+    }
+    if(method == "rpc/peer/call") {
+        Connect *job = _new_job(conn->name, conn->body, conn->priority);
+        job->gen_id();
+        job->peer = peer;
+        job->peer_id.set(conn->id);
+        job->deadline = conn->deadline;
+        if(client_request(job->name, job) < 0) {
+            peer->send_result(job->peer_id, NULL);
+            job->unlink();
+        }
+    } else if(method == "rpc/peer/result") {
+        peer->call_done(conn->id);
+        worker_result(conn->id, failed ? NULL : conn);
+    } else if(method == "rpc/peer/summary") {
+        peer->set_summary(conn->body);
+    }
+}
@@ -3,11 +3,24 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <deque>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <memory>
 #include "utils.h"
 #include "mapper.h"
+#include "timer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "cache.h"
+#include "wal.h"
+#include "results.h"
+#include "peer.h"
+#include "handover.h"
+#include "affinity.h"
 
 
 #define MAX_EVENTS 16384
@@ -17,10 +30,65 @@ class Loop;
 class Connect;
 
 
+#define PRIORITY_LEVELS 64  // priority -32..31, other values are clamped
+#define FAIR_STRIDE (1 << 20)  // pass of a method grows by FAIR_STRIDE / weight per task
+#define MAX_WEIGHT 1000
+#define JOB_MAX_ATTEMPTS 5  // a job fails after so many lost workers
+#define JOB_RETRY_MS 60000  // a job fails if it can't be queued for so long
+
+
+class ClientQueue {
+private:
+    // intrusive FIFO per priority level, bit is set for non-empty level
+    Connect *_head[PRIORITY_LEVELS];
+    Connect *_tail[PRIORITY_LEVELS];
+    u64 _bits = 0;
+    int _size = 0;
+public:
+    ClientQueue() {
+        memset(_head, 0, sizeof(_head));
+        memset(_tail, 0, sizeof(_tail));
+    };
+    void push(Connect *client);
+    Connect *pop();
+    Connect *lowest();
+    void remove(Connect *client);
+    inline int size() {return _size;}
+    static int level(int priority);
+};
+
+
 class Queue {
 public:
     std::deque<Connect*> workers;
-    std::deque<Connect*> clients;
+    ClientQueue clients;
+};
+
+
+class Broadcast {
+public:
+    std::mutex mutex;
+    Connect *client;  // linked
+    std::shared_ptr<Buffer> body;  // the same for all workers
+    int need;  // results for a reply
+    int pending;  // parts without a result
+    int delivered;
+    int results = 0;
+    int refs;  // parts and the client
+    bool done = false;  // the reply is sent or being sent
+    Buffer result;  // the first result, or a json array of results
+};
+
+
+class QueueLimits {
+public:
+    int queue = 0;  // waiting clients, 0 - no limit
+    i64 bytes = 0;  // bodies of waiting clients
+    int inflight = 0;  // waiting and processing clients
+    bool drop_oldest = false;  // policy for a full queue, reject a new client by default
+    int cache = 0;  // ms, ttl of cached results, 0 - off
+    bool coalesce = false;  // the same calls in flight wait for one result
+    bool durable = false;  // calls are jobs in the write-ahead log
 };
 
 
@@ -31,31 +99,89 @@ public:
     std::mutex mutex;
     Queue *queue;
     Buffer info;
-    QueueLine(int n) {
+    QueueLimits limits;  // under mutex
+    std::atomic<int> queued{0};  // changed under mutex
+    i64 queued_bytes = 0;
+    std::atomic<int> inflight{0};
+    u64 shed = 0;  // requests dropped after their deadline, under mutex
+    u64 rejected = 0;  // requests over limits, under mutex
+    int weight = 1;  // share of shared workers
+    std::atomic<u64> pass{0};  // virtual time of served tasks, the lowest is served first
+    MethodMetrics *metrics;  // per loop
+    std::atomic<bool> cacheable{false};  // results are cached, by limits or by a Cache header
+    std::atomic<bool> durable{false};  // by --durable or limits, never reset
+    std::atomic<bool> coalesce{false};  // copies of limits, changed under mutex
+    std::atomic<int> cache_ttl{0};
+    QueueLine(u32 n) {
         queue = new Queue[n];
+        metrics = new MethodMetrics[n];
     }
     ~QueueLine() {
         delete[] queue;
+        delete[] metrics;
     }
 };
 
 
 class Server {
 private:
-    int _fd;
+    int _fd = -1;
+    int _handover_fd = -1;  // listening for a new process
+    int _handover_in = -1;  // workers of the old process
+    int _handover_count = 0;
+    long _drain_until = 0;  // ms
     void _listen();
     void _accept();
     bool _valid_ip(u32 ip);
+    bool _wait_accept();
+    void _handover_give();
+    void _handover_worker();
+    bool _drained();
+    void _place_loops();
+    int _incoming_loop(int fd);
 public:
     int active_loop = 0;
     int max_fd = 0;
     Slice host;
     int log = 0;
+    bool log_json = false;
     int port = 8001;
     int threads = 1;
     bool jsonrpc2 = false;
+    int client_timeout = 0;  // ms, 0 - no limit
+    int worker_timeout = 0;
+    int idle_timeout = 0;
+    int trace_rate = 0;  // trace 1 of N client requests, 0 - off
+    const char *capture_path = NULL;  // files <path>.<loop>
+    bool capture_body = false;
+    u64 capture_start = 0;
+    i64 cache_size = 0;  // bytes, 0 - no result cache
+    ResultCache *cache = NULL;
+    i64 results_size = 64 << 20;  // bytes, results of async calls
+    int results_ttl = 300000;  // ms
+    ResultStore *results = NULL;
+    const char *wal_dir = NULL;  // durable jobs are off without it
+    int wal_sync = 0;  // ms, interval of group commit, 0 - every loop iteration
+    int wal_gen = 0;  // generation of log files
+    std::vector<std::string> durable;  // "name" or "prefix*"
+    std::vector<std::string> peer_names;  // --peer host:port
+    std::vector<Peer*> peers;
+    std::vector<std::pair<u32, Peer*>> ring;  // hashes of nodes for method names, NULL - this node
+    std::string node_name;  // --node-name or host:port, as other nodes list it in --peer
+    std::mutex peer_lock;
+    std::vector<std::string> peer_failed;  // forwarded calls of a lost link, failed on loop 0
+    const char *handover_path = NULL;  // unix socket of a restart
+    int handover_out = -1;  // to the new process, waiting workers are sent by loops
+    std::atomic<bool> draining{false};  // the new process accepts, this one finishes requests
+    std::vector<int> cpus;  // --cpus, loop i is pinned to cpus[i % size]
+    bool numa = false;  // loops use memory of their node
+    std::vector<int> cpu_loop;  // cpu -> loop pinned to it, -1 - none
+    std::atomic<u64> hot_loops{0};  // bits of loops over LOOP_HOT, set by the balancer
     int fake_fd = 0;
     std::vector<NetFilter> net_filter;
+    QueueLimits limits;  // default for new methods
+    std::vector<std::pair<std::string, int>> weights;  // "name" or "prefix*"
+    std::atomic<u64> fair_pass{0};  // pass of the last served method
     Connect *connections[MAX_EVENTS];
     Loop **loops;
     std::mutex global_lock;
@@ -73,9 +199,20 @@ public:
     Mapper _mapper;
     std::vector<QueueLine*> _queue_list;
     QueueLine *get_queue(ISlice key, bool create=false);
+    void get_queues(std::vector<QueueLine*> &result);
+    int get_weight(ISlice name);
+    bool is_durable(ISlice name);
+    Peer *find_peer(ISlice name);
+    Peer *pick_peer(ISlice method);
+    bool remote_idle(ISlice method);
 
     std::map<std::string, Connect*> wait_response;
     std::mutex wait_lock;
+
+    std::unordered_map<u64, std::pair<QueueLine*, Connect*>> coalesce_calls;  // leaders by hash of method + body
+    std::mutex coalesce_lock;
+    bool coalesce(QueueLine *ql, Connect *client);
+    void coalesce_done(Connect *leader, Connect *worker);
 };
 
 
@@ -84,12 +221,36 @@ private:
     int epollfd;
     int _nloop;
     std::thread _thread;
+    TimerWheel _timers;
+    std::mutex _arm_lock;
+    std::vector<Connect*> _arm_list;
+    std::vector<std::pair<u64, Slice>> _fair_order;
+    int _trace_count = 0;
+    Buffer _cache_result;
+    std::vector<std::pair<Connect*, std::string>> _wal_acks;  // clients waiting for a commit, job id
+    long _wal_sync_at = 0;
+    std::vector<Connect*> _requeue;  // jobs to queue again
+    long _requeue_at = 0;
+    std::vector<Connect*> _store_waiters;
+    Buffer _fetch_result;
+    std::vector<Connect*> _adopted;  // workers of the old process, under _arm_lock
 
     void _loop();
     void _loop_safe();
     void _close(int fd);
+    void _on_timer(Connect *conn);
+    void _drain();
 public:
+    long now = 0;  // ms, updated on every iteration
     bool accept_request = false;
+    u64 requests = 0;  // client calls, written by own thread only
+    LoopMetrics metrics;
+    TraceRing *traces = NULL;  // if tracing is on
+    Capture *capture = NULL;  // if capture is on
+    Wal *wal = NULL;  // if durable jobs are on
+    u64 now_us = 0;  // updated once per iteration, latency metrics and recv of traces use it
+    std::vector<int> cpus;  // the thread is pinned to, empty - any
+    int node = -1;  // memory node, -1 - any
     Server *server;
     std::vector<Connect*> dead_connections;
     std::mutex del_lock;
@@ -97,14 +258,37 @@ public:
     Loop(Server *server, int nloop);
     void start();
     void accept(Connect *conn);
+    void adopt_worker(Connect *conn);
     void set_poll_mode(int fd, int status);
     void wake();
     inline auto get_id() {return _thread.native_handle();}
+    void set_timer(Connect *conn, long expire);
+    void trace_done(Connect *conn);
 
 // rpc
 private:
     int _add_worker(Slice name, Connect *worker);
+    bool _drop_client(Connect *client, bool shed=true);
+    void _send_task(Connect *worker, Connect *client, QueueLine *ql, ISlice &name, ISlice *id);
+    void _hold_job(Connect *worker, Connect *job);
+    void _count_result(Connect *client, Connect *worker);
+    Connect *_pop_oldest(QueueLine *ql, Connect *client);
+    Connect *_new_job(ISlice &name, ISlice &body, int priority);
+    int _submit_job(QueueLine *ql, Connect *client);
+    void _job_end(Connect *job, bool done, ISlice *result=NULL);
+    void _store_result(ISlice &id, ISlice *result);
+    void _retry_jobs();
+    void _wal_commit();
+    int _broadcast(QueueLine *ql, Connect *client);
+    void _broadcast_result(Connect *part, Connect *worker);
+    void _broadcast_reply(Broadcast *b, bool timeout);
+    void _broadcast_unref(Broadcast *b);
+    int _forward(Peer *peer, QueueLine *ql, Connect *client);
+    void _peer_failed();
 public:
+    void peer_message(Connect *conn, ISlice &method, bool failed);
+    void restore_job(WalJob &job);
+    void fetch_result(Connect *client);
     void on_disconnect(Connect *conn);
     void add_worker(ISlice name, Connect *worker);
     int client_request(ISlice name, Connect *client);
@@ -0,0 +1,150 @@
+
+#include "timer.h"
+
+
+/*
+    Hierarchical timing wheel, 4 levels x 64 slots, 1ms tick.
+    A slot on level N covers 64^N ms, timers move down a level when the lower level wraps.
+    Add and remove are O(1), empty ticks are skipped with per-level bitmaps.
+*/
+
+
+TimerWheel::TimerWheel() {
+    for(int i=0;i<WHEEL_LEVELS * WHEEL_SIZE;i++) {
+        _slots[i].prev = _slots[i].next = &_slots[i];
+    }
+    _expired.prev = _expired.next = &_expired;
+    memset(_bits, 0, sizeof(_bits));
+}
+
+void TimerWheel::_link(Timer *head, Timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void TimerWheel::_insert(Timer *t) {
+    long expire = t->expire;
+    if(expire < _now) expire = _now;
+    long delta = expire - _now;
+
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= (1L << (WHEEL_BITS * (level + 1)))) level++;
+    if(level == WHEEL_LEVELS - 1) {
+        long max = (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        if(delta > max) expire = _now + max;
+    }
+
+    int index = (expire >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    t->slot = level * WHEEL_SIZE + index;
+    _link(&_slots[t->slot], t);
+    _bits[level] |= 1ULL << index;
+}
+
+void TimerWheel::add(Timer *t, long expire) {
+    if(t->active()) remove(t);
+    t->expire = expire;
+    _insert(t);
+    _count++;
+}
+
+void TimerWheel::remove(Timer *t) {
+    if(!t->active()) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if(t->slot >= 0) {
+        Timer *head = &_slots[t->slot];
+        if(head->next == head) _bits[t->slot / WHEEL_SIZE] &= ~(1ULL << (t->slot % WHEEL_SIZE));
+    }
+    t->prev = t->next = NULL;
+    _count--;
+}
+
+void TimerWheel::_cascade(int level) {
+    int index = (_now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    Timer *head = &_slots[level * WHEEL_SIZE + index];
+    _bits[level] &= ~(1ULL << index);
+    Timer *t = head->next;
+    head->prev = head->next = head;
+    while(t != head) {
+        Timer *next = t->next;
+        _insert(t);
+        t = next;
+    }
+}
+
+long TimerWheel::_next_tick() {
+    // the earliest tick with timers to fire or to cascade
+    long best = -1;
+    for(int level=0;level<WHEEL_LEVELS;level++) {
+        u64 bits = _bits[level];
+        if(!bits) continue;
+        int shift = WHEEL_BITS * level;
+        long pos = _now >> shift;
+        if(_now & ((1L << shift) - 1)) pos++;  // current slot of this level is cascaded already
+        int index = pos & (WHEEL_SIZE - 1);
+        u64 rotated = index ? (bits >> index) | (bits << (WHEEL_SIZE - index)) : bits;
+        long tick = (pos + __builtin_ctzll(rotated)) << shift;
+        if(best == -1 || tick < best) best = tick;
+    }
+    return best;
+}
+
+void TimerWheel::_advance(long now) {
+    while(_now <= now) {
+        long tick = _next_tick();
+        if(tick == -1 || tick > now) {
+            _now = now + 1;
+            return;
+        }
+        _now = tick;
+        for(int level=1;level<WHEEL_LEVELS;level++) {
+            if(_now & ((1L << (WHEEL_BITS * level)) - 1)) break;
+            _cascade(level);
+        }
+
+        int index = _now & (WHEEL_SIZE - 1);
+        Timer *head = &_slots[index];
+        if(head->next != head) {
+            // move the slot to the expired list
+            Timer *first = head->next;
+            Timer *last = head->prev;
+            first->prev = _expired.prev;
+            _expired.prev->next = first;
+            last->next = &_expired;
+            _expired.prev = last;
+            head->prev = head->next = head;
+            _bits[0] &= ~(1ULL << index);
+            for(Timer *t=first;t!=&_expired;t=t->next) t->slot = -1;
+        }
+        _now++;
+    }
+}
+
+Timer *TimerWheel::pop(long now) {
+    if(_expired.next == &_expired) {
+        if(!_count) {
+            _now = now + 1;
+            return NULL;
+        }
+        _advance(now);
+        if(_expired.next == &_expired) return NULL;
+    }
+    Timer *t = _expired.next;
+    _expired.next = t->next;
+    t->next->prev = &_expired;
+    t->prev = t->next = NULL;
+    _count--;
+    return t;
+}
+
+int TimerWheel::timeout(long now) {
+    // ms to the next tick for epoll_wait, -1 if there are no timers
+    if(_expired.next != &_expired) return 0;
+    if(!_count) return -1;
+    long tick = _next_tick();
+    if(tick <= now) return 0;
+    if(tick - now > 1'000'000) return 1'000'000;
+    return tick - now;
+}
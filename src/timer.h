@@ -0,0 +1,44 @@
+#pragma once
+
+#include "utils.h"
+
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4  // 1ms, 64ms, 4s, 4.6min slots
+
+
+class Timer {
+public:
+    Timer *prev = NULL;
+    Timer *next = NULL;
+    long expire = 0;  // ms
+    int slot = 0;
+    void *owner = NULL;
+
+    inline bool active() {return prev != NULL;}
+};
+
+
+class TimerWheel {
+private:
+    Timer _slots[WHEEL_LEVELS * WHEEL_SIZE];
+    u64 _bits[WHEEL_LEVELS];
+    Timer _expired;
+    long _now = 0;  // next tick to process
+    int _count = 0;
+
+    void _link(Timer *head, Timer *t);
+    void _insert(Timer *t);
+    void _cascade(int level);
+    long _next_tick();
+    void _advance(long now);
+public:
+    TimerWheel();
+    void start(long now) {_now = now;};
+    void add(Timer *t, long expire);
+    void remove(Timer *t);
+    Timer *pop(long now);
+    int timeout(long now);
+    inline int size() {return _count;}
+};
@@ -0,0 +1,98 @@
+
+#include "trace.h"
+#include "server.h"
+
+
+void Trace::copy(const Trace &t) {
+    queue = t.queue;
+    fd = t.fd;
+    loop = t.loop;
+    accept_us = t.accept_us;
+    recv_us = t.recv_us;
+    request_us = t.request_us;
+    task_us = t.task_us;
+    result_us = t.result_us;
+    sent_us = t.sent_us;
+}
+
+
+Trace *TraceRing::begin() {
+    u64 head = _head.load(std::memory_order_relaxed);
+    Trace *t = &_items[head % TRACE_RING];
+    t->seq.store(head * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return t;
+}
+
+void TraceRing::commit(Trace *t) {
+    u64 head = _head.load(std::memory_order_relaxed);
+    t->seq.store(head * 2 + 2, std::memory_order_release);
+    _head.store(head + 1, std::memory_order_release);
+}
+
+void TraceRing::read(std::vector<Trace> &result) {
+    // seqlock: an item is skipped if the writer has touched it during the copy
+    u64 head = _head.load(std::memory_order_acquire);
+    u64 start = head > TRACE_RING ? head - TRACE_RING : 0;
+    for(u64 i=start;i<head;i++) {
+        Trace *t = &_items[i % TRACE_RING];
+        u64 seq = t->seq.load(std::memory_order_acquire);
+        if(seq != i * 2 + 2) continue;
+        result.emplace_back();
+        result.back().copy(*t);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(t->seq.load(std::memory_order_relaxed) != seq) result.pop_back();
+    }
+}
+
+
+static void add_escaped(Buffer &res, ISlice value) {
+    char *ptr = value.ptr();
+    for(int i=0;i<value.size();i++) {
+        unsigned char c = ptr[i];
+        if(c == '"' || c == '\\') res.add("\\", 1);
+        if(c < 0x20) res.add("?", 1);
+        else res.add(&ptr[i], 1);
+    }
+}
+
+static void add_event(Buffer &res, const char *name, const Trace &t, int tid, u64 start, u64 end) {
+    if(!start || !end || end < start) return;
+    res.add("{\"name\":\"");
+    res.add(name);
+    res.add("\",\"cat\":\"");
+    if(t.queue) add_escaped(res, t.queue->name);
+    res.add("\",\"ph\":\"X\",\"pid\":");
+    res.add_number(t.loop);
+    res.add(",\"tid\":");
+    res.add_number(tid);
+    res.add(",\"ts\":");
+    res.add_number(start);
+    res.add(",\"dur\":");
+    res.add_number(end - start);
+    res.add("},\n");
+}
+
+void render_trace(Server *server, Buffer &res) {
+    // Chrome trace event format, loads in Perfetto and chrome://tracing
+    // a request is a thread, a loop is a process
+    std::vector<Trace> traces;
+    for(int n=0;n<server->threads;n++) {
+        TraceRing *ring = server->loops[n]->traces;
+        if(ring) ring->read(traces);
+    }
+
+    res.add("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int tid = 0;
+    for(const Trace &t : traces) {
+        tid++;
+        add_event(res, "request", t, tid, t.accept_us ? t.accept_us : t.recv_us, t.sent_us);
+        add_event(res, "connect", t, tid, t.accept_us, t.recv_us);
+        add_event(res, "parse", t, tid, t.recv_us, t.request_us);
+        add_event(res, "queue", t, tid, t.request_us, t.task_us);
+        add_event(res, "service", t, tid, t.task_us, t.result_us);
+        add_event(res, "send", t, tid, t.result_us ? t.result_us : t.request_us, t.sent_us);
+    }
+    if(traces.size()) res.resize(0, res.size() - 2);
+    res.add("\n]}");
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "utils.h"
+
+
+#define TRACE_RING 1024  // traces kept per loop
+
+
+class QueueLine;
+
+class Trace {
+public:
+    std::atomic<u64> seq{0};  // odd while the item is being written
+    QueueLine *queue = NULL;
+    int fd = 0;
+    int loop = 0;
+    u64 accept_us = 0;  // 0 if the connection was accepted for an earlier request
+    u64 recv_us = 0;  // the first data of the request
+    u64 request_us = 0;  // request is parsed
+    u64 task_us = 0;  // task is sent to a worker
+    u64 result_us = 0;  // result is received
+    u64 sent_us = 0;  // response is sent out
+
+    Trace() {}
+    Trace(const Trace &t) {copy(t);}
+    void copy(const Trace &t);
+};
+
+
+class TraceRing {
+private:
+    Trace _items[TRACE_RING];
+    std::atomic<u64> _head{0};
+public:
+    Trace *begin();  // writer, the own loop only
+    void commit(Trace *t);
+    void read(std::vector<Trace> &result);
+};
+
+
+class Server;
+void render_trace(Server *server, Buffer &res);
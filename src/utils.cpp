@@ -18,34 +18,18 @@ long get_time_sec() {
 }
 
 
-Buffer lbuf(22);
-
-const char *ltime() {
-    // thread unsafe
-    std::time_t t = std::time(0);
-    std::tm* now = std::localtime(&t);
-
-    lbuf.clear();
-    lbuf.add_number(now->tm_year + 1900);
-    lbuf.add("-", 1);
-    int mon = now->tm_mon + 1;
-    if(mon < 10) lbuf.add("0", 1);
-    lbuf.add_number(mon);
-    lbuf.add("-", 1);
-    if(now->tm_mday < 10) lbuf.add("0", 1);
-    lbuf.add_number(now->tm_mday);
-    lbuf.add(" ", 1);
-    if(now->tm_hour < 10) lbuf.add("0", 1);
-    lbuf.add_number(now->tm_hour);
-    lbuf.add(":", 1);
-    if(now->tm_min < 10) lbuf.add("0", 1);
-    lbuf.add_number(now->tm_min);
-    lbuf.add(":", 1);
-    if(now->tm_sec < 10) lbuf.add("0", 1);
-    lbuf.add_number(now->tm_sec);
-    lbuf.add(" ", 1);
+long get_time_ms() {
+    // monotonic, for timeouts
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &spec);
+    return spec.tv_sec * 1000 + spec.tv_nsec / 1'000'000;
+}
 
-    return lbuf.ptr();
+u64 get_time_us() {
+    // monotonic, for latency metrics
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (u64)spec.tv_sec * 1'000'000 + spec.tv_nsec / 1000;
 }
 
 
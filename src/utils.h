@@ -13,12 +13,14 @@ static const char *ijson_version = "0.3.8";
 #include "exception.h"
 #include "buffer.h"
 #include "netfilter.h"
+#include "log.h"
 
 #define LOCK std::lock_guard<std::mutex>
 
 long get_time();
 long get_time_sec();
-const char *ltime();
+long get_time_ms();
+u64 get_time_us();
 
 class Server;
 
@@ -0,0 +1,216 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <algorithm>
+#include <tuple>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+
+/*
+    Write-ahead log of durable jobs, one per loop.
+    Segments are mapped files, a new segment is started when the current one is full,
+    the oldest segment is removed when all its jobs have results.
+    Records are synced by a group commit of the loop, results are not synced.
+    The directory is synced with them after a segment is created or removed,
+    otherwise a new segment with acknowledged jobs can be lost on a crash.
+*/
+
+
+static u32 checksum(const char *p, u32 size) {
+    // FNV-1a
+    u32 h = 2166136261u;
+    for(u32 i=0;i<size;i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+Wal::~Wal() {
+    for(auto &s : _segments) {
+        munmap(s.map, WAL_SEGMENT);
+        ::close(s.fd);
+    }
+    if(_dir_fd >= 0) ::close(_dir_fd);
+}
+
+void Wal::open(const char *dir, int gen, int nloop) {
+    _prefix = std::string(dir) + "/" + std::to_string(gen) + "-" + std::to_string(nloop) + "-";
+    _dir_fd = ::open(dir, O_RDONLY | O_DIRECTORY);
+    if(_dir_fd < 0) THROW("Wal: can't open dir");
+    _open_segment();
+}
+
+void Wal::_open_segment() {
+    WalSegment s;
+    s.seq = _next_seq++;
+    s.path = _prefix + std::to_string(s.seq) + ".wal";
+    s.fd = ::open(s.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(s.fd < 0) THROW("Wal: can't open file");
+    if(ftruncate(s.fd, WAL_SEGMENT)) THROW("Wal: ftruncate");
+    void *p = mmap(NULL, WAL_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, s.fd, 0);
+    if(p == MAP_FAILED) THROW("Wal: mmap");
+    s.map = (char*)p;
+    WalHeader *header = (WalHeader*)s.map;
+    memcpy(header->magic, WAL_MAGIC, 8);
+    s.pos = sizeof(WalHeader);
+    s.synced = 0;
+    s.live = 0;
+    _segments.push_back(s);
+    _dir_changed = true;
+}
+
+void Wal::_append(int type, ISlice &id, ISlice *method, ISlice *body, int priority) {
+    // under _mutex
+    u32 method_size = method ? method->size() : 0;
+    u32 body_size = body ? body->size() : 0;
+    u32 size = (sizeof(WalRecord) + id.size() + method_size + body_size + 7) & ~7;
+    if(_segments.back().pos + size > WAL_SEGMENT) _open_segment();
+
+    WalSegment &s = _segments.back();
+    char *ptr = &s.map[s.pos];
+    WalRecord *r = (WalRecord*)ptr;
+    r->type = type;
+    r->id_size = id.size();
+    r->method_size = method_size;
+    r->priority = priority;
+    r->body_size = body_size;
+    r->reserved = 0;
+    ptr += sizeof(WalRecord);
+    memcpy(ptr, id.ptr(), id.size());
+    ptr += id.size();
+    if(method_size) memcpy(ptr, method->ptr(), method_size);
+    ptr += method_size;
+    if(body_size) memcpy(ptr, body->ptr(), body_size);
+    r->checksum = checksum((char*)&r->type, size - 8);
+    r->size = size;
+    s.pos += size;
+}
+
+void Wal::add_job(ISlice &id, ISlice &method, ISlice &body, int priority) {
+    LOCK _l(_mutex);
+    _append(WAL_JOB, id, &method, &body, priority);
+    WalSegment &s = _segments.back();
+    s.live++;
+    _jobs[id.as_string()] = s.seq;
+}
+
+void Wal::done(ISlice &id) {
+    LOCK _l(_mutex);
+    auto it = _jobs.find(id.as_string());
+    if(it == _jobs.end()) return;
+    u64 seq = it->second;
+    _jobs.erase(it);
+    _append(WAL_DONE, id, NULL, NULL, 0);
+    for(auto &s : _segments) {
+        if(s.seq == seq) {
+            s.live--;
+            break;
+        }
+    }
+
+    // segments are removed in order, so a result is never older than its job
+    while(_segments.size() > 1 && _segments.front().live == 0) {
+        WalSegment &s = _segments.front();
+        munmap(s.map, WAL_SEGMENT);
+        ::close(s.fd);
+        unlink(s.path.c_str());
+        _segments.pop_front();
+        _dir_changed = true;
+    }
+}
+
+void Wal::sync() {
+    // group commit: written records of all segments go to disk
+    LOCK _l(_mutex);
+    for(auto &s : _segments) {
+        if(s.synced >= s.pos) continue;
+        u32 start = s.synced & ~4095;
+        if(msync(s.map + start, s.pos - start, MS_SYNC)) THROW("Wal: msync");
+        s.synced = s.pos;
+    }
+    if(_dir_changed) {
+        if(fsync(_dir_fd)) THROW("Wal: fsync of dir");
+        _dir_changed = false;
+    }
+}
+
+void wal_sync_dir(const char *dir) {
+    int fd = ::open(dir, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) THROW("Wal: can't open dir");
+    int r = fsync(fd);
+    ::close(fd);
+    if(r) THROW("Wal: fsync of dir");
+}
+
+
+int wal_load(const char *dir, std::vector<WalJob> &jobs, std::vector<std::string> &files) {
+    // reads jobs without results from all logs, returns the next generation
+    std::vector<std::tuple<int, int, u64, std::string>> names;  // generation, loop, seq
+    DIR *d = opendir(dir);
+    if(!d) THROW("Wal: can't open dir");
+    struct dirent *e;
+    while((e = readdir(d))) {
+        int gen, nloop;
+        unsigned long long seq;
+        char tail[8];
+        if(sscanf(e->d_name, "%d-%d-%llu.%7s", &gen, &nloop, &seq, tail) != 4 || strcmp(tail, "wal")) continue;
+        names.push_back({gen, nloop, seq, std::string(dir) + "/" + e->d_name});
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    std::unordered_map<std::string, size_t> index;
+    int next_gen = 0;
+    for(auto &n : names) {
+        const std::string &path = std::get<3>(n);
+        if(std::get<0>(n) >= next_gen) next_gen = std::get<0>(n) + 1;
+        files.push_back(path);
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) continue;
+        struct stat st;
+        fstat(fd, &st);
+        size_t size = st.st_size;
+        char *map = size >= sizeof(WalHeader) ? (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : (char*)MAP_FAILED;
+        ::close(fd);
+        if(map == MAP_FAILED) continue;
+        if(memcmp(map, WAL_MAGIC, 8)) {
+            munmap(map, size);
+            continue;
+        }
+
+        size_t pos = sizeof(WalHeader);
+        while(pos + sizeof(WalRecord) <= size) {
+            WalRecord *r = (WalRecord*)&map[pos];
+            if(r->size < sizeof(WalRecord) || pos + r->size > size) break;
+            if(r->size < sizeof(WalRecord) + r->id_size + r->method_size + r->body_size) break;
+            if(r->checksum != checksum((char*)&r->type, r->size - 8)) break;  // torn write
+            const char *p = &map[pos + sizeof(WalRecord)];
+            std::string id(p, r->id_size);
+            if(r->type == WAL_JOB) {
+                if(!index.count(id)) {
+                    // a job is written again on restore, the first copy is used
+                    index[id] = jobs.size();
+                    WalJob job;
+                    job.id = id;
+                    job.method.assign(p + r->id_size, r->method_size);
+                    job.body.assign(p + r->id_size + r->method_size, r->body_size);
+                    job.priority = r->priority;
+                    jobs.push_back(std::move(job));
+                }
+            } else if(r->type == WAL_DONE) {
+                auto it = index.find(id);
+                if(it != index.end()) jobs[it->second].id.clear();
+            }
+            pos += r->size;
+        }
+        munmap(map, size);
+    }
+
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const WalJob &j) {return j.id.empty();}), jobs.end());
+    return next_gen;
+}
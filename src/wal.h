@@ -0,0 +1,80 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "utils.h"
+
+
+#define WAL_SEGMENT (64 << 20)  // file size, a segment is mapped whole
+#define WAL_MAX_BODY (WAL_SEGMENT / 4)
+#define WAL_MAGIC "IJWAL01"
+
+#define WAL_JOB 1
+#define WAL_DONE 2
+
+
+struct WalHeader {
+    char magic[8];
+    u64 reserved;
+};
+
+
+struct WalRecord {
+    u32 size;  // whole record, aligned to 8, 0 - end of data
+    u32 checksum;  // of the rest of the record
+    u16 type;
+    u16 id_size;
+    u16 method_size;
+    int16_t priority;
+    u32 body_size;
+    u32 reserved;
+    // id, method, body
+};
+
+
+class WalJob {
+public:
+    std::string id;
+    std::string method;
+    std::string body;
+    int priority = 0;
+};
+
+
+class WalSegment {
+public:
+    u64 seq;
+    int fd;
+    char *map;
+    u32 pos;  // write position
+    u32 synced;
+    int live;  // jobs without a result
+    std::string path;
+};
+
+
+class Wal {
+private:
+    std::mutex _mutex;
+    std::string _prefix;  // <dir>/<generation>-<loop>-
+    int _dir_fd = -1;
+    bool _dir_changed = false;  // a segment is created or removed since the last sync
+    std::deque<WalSegment> _segments;  // the last one is written
+    std::unordered_map<std::string, u64> _jobs;  // live job id -> segment seq
+    u64 _next_seq = 0;
+    void _open_segment();
+    void _append(int type, ISlice &id, ISlice *method, ISlice *body, int priority);
+public:
+    ~Wal();
+    void open(const char *dir, int gen, int nloop);
+    void add_job(ISlice &id, ISlice &method, ISlice &body, int priority);
+    void done(ISlice &id);
+    void sync();
+};
+
+
+int wal_load(const char *dir, std::vector<WalJob> &jobs, std::vector<std::string> &files);
+void wal_sync_dir(const char *dir);
@@ -1,11 +1,15 @@
 
+import os
 import time
+import socket
 import threading
+import subprocess
 import requests
 
 
 L = 'http://localhost:8001'
 TIMEOUT = 5
+IJSON = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'ijson')
 
 def post(path, *a, **kw):
     if 'timeout' not in kw:
@@ -301,3 +305,579 @@ def test6_priority():
         worker.post(L + '/rpc/result', json={'result': task['request']})
     time.sleep(0.5)
     assert result == [0, 2, 9, 4, 6, 1, 8, 7, 5, 3]
+
+
+def test_deadline():
+    timeout = None
+
+    @run(0)
+    def worker():
+        nonlocal timeout
+        r = post('/rpc/add', json={'name': 'test/deadline'})
+        timeout = int(r.headers['Timeout'])
+        post('/rpc/result', json={'result': 'ok'}, headers={'Id': r.headers['Id']})
+
+    time.sleep(0.1)
+    r = post('/test/deadline', json={'params': 1}, headers={'Timeout': '3000'})
+    assert r.status_code == 200
+    assert 0 < timeout <= 3000
+
+    # no worker takes it in time
+    start = time.time()
+    r = post('/test/deadline', json={'params': 2}, headers={'Timeout': '200'})
+    assert r.status_code == 504
+    assert 0.15 < time.time() - start < 1
+
+    # already expired
+    r = post('/test/deadline', json={'params': 3}, headers={'Deadline': str(int(time.time() * 1000) - 1000)})
+    assert r.status_code == 504
+
+    details = post('/rpc/details').json()
+    assert details['test/deadline']['shed'] == 2
+
+
+def test_limits():
+    codes = {}
+
+    def request(delay, name, value):
+        @run(delay)
+        def send():
+            codes[value] = post('/' + name, json={'value': value}).status_code
+
+    # the worker holds the first call, then 2 clients can wait
+    worker = requests.Session()
+    request(0.1, 'test/limits', 1)
+    task = worker.post(L + '/rpc/add', json={'name': 'test/limits', 'option': 'no_id', 'limits': {'queue': 2}}, timeout=TIMEOUT).json()
+    assert task['value'] == 1
+    request(0, 'test/limits', 2)
+    request(0.1, 'test/limits', 3)
+    request(0.2, 'test/limits', 4)
+    time.sleep(0.4)
+    assert codes == {4: 429}
+
+    details = post('/rpc/details').json()
+    assert details['test/limits']['clients'] == 2
+    assert details['test/limits']['rejected'] == 1
+
+    for _ in range(2):
+        worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+        worker.post(L + '/rpc/add', json={'name': 'test/limits', 'option': 'no_id'}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    time.sleep(0.1)
+    assert codes == {1: 200, 2: 200, 3: 200, 4: 429}
+
+    # the oldest waiting client is dropped
+    codes.clear()
+    drop = requests.Session()
+
+    @run(0)
+    def drop_worker():
+        drop.post(L + '/rpc/add', json={'name': 'test/drop', 'option': 'no_id', 'limits': {'queue': 1, 'policy': 'drop_oldest'}}, timeout=TIMEOUT)
+
+    request(0.1, 'test/drop', 1)
+    request(0.2, 'test/drop', 2)
+    request(0.3, 'test/drop', 3)
+    time.sleep(0.5)
+    assert codes == {2: 503}
+    drop.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    drop.post(L + '/rpc/add', json={'name': 'test/drop', 'option': 'no_id'}, timeout=TIMEOUT)
+    drop.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    time.sleep(0.1)
+    assert codes == {1: 200, 2: 503, 3: 200}
+
+    # waiting and processing clients
+    codes.clear()
+    inflight = requests.Session()
+    request(0.1, 'test/inflight', 1)
+    inflight.post(L + '/rpc/add', json={'name': 'test/inflight', 'option': 'no_id', 'limits': {'inflight': 1}}, timeout=TIMEOUT)
+    r = post('/test/inflight', json={'value': 2})
+    assert r.status_code == 503
+    inflight.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    time.sleep(0.1)
+    assert codes == {1: 200}
+
+    # a client which has gone leaves the queue
+    s = socket.create_connection(('localhost', 8001))
+    s.sendall(b'POST /test/limits HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}')
+    time.sleep(0.1)
+    assert post('/rpc/details').json()['test/limits']['clients'] == 1
+    s.close()
+    time.sleep(0.1)
+    assert post('/rpc/details').json()['test/limits']['clients'] == 0
+
+
+def test_drop_lowest():
+    codes = {}
+
+    def request(delay, value, priority):
+        @run(delay)
+        def send():
+            codes[value] = post('/test/drop_lowest', json={'value': value}, headers={'Priority': str(priority)}).status_code
+
+    # the worker holds the first call, then 2 clients can wait
+    worker = requests.Session()
+    request(0.1, 1, 0)
+    worker.post(L + '/rpc/add', json={'name': 'test/drop_lowest', 'option': 'no_id', 'limits': {'queue': 2, 'policy': 'drop_oldest'}}, timeout=TIMEOUT)
+    request(0, 2, 5)
+    request(0.1, 3, 0)
+    request(0.2, 4, 1)  # the lowest waiting client is dropped
+    request(0.3, 5, -1)  # lower than all waiting clients
+    time.sleep(0.5)
+    assert codes == {3: 503, 5: 429}
+
+    worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/add', json={'name': 'test/drop_lowest', 'option': 'no_id'}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/add', json={'name': 'test/drop_lowest', 'option': 'no_id'}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+    time.sleep(0.1)
+    assert codes == {1: 200, 2: 200, 3: 503, 4: 200, 5: 429}
+
+
+def test_priority_levels():
+    result = []
+
+    @run(0)
+    def worker():
+        worker = requests.Session()
+        task = worker.post(L + '/rpc/add', json={'name': 'test/levels', 'option': 'no_id'}).json()
+        worker.post(L + '/rpc/result', json={'result': task['request']}, timeout=TIMEOUT)
+
+    time.sleep(0.1)
+    response = post('/test/levels', json={'request': 0}).json()
+    result.append(response['result'])
+
+    def request(delay, value, priority):
+        @run(delay)
+        def send():
+            response = post('/test/levels', json={'request': value}, headers={'Priority': str(priority)}).json()
+            result.append(response['result'])
+
+    # values out of -32..31 are clamped, the same level is FIFO
+    request(0.1, 1, 0)
+    request(0.2, 2, 100)
+    request(0.3, 3, -100)
+    request(0.4, 4, 31)
+    request(0.5, 5, -32)
+    request(0.6, 6, 0)
+    request(0.7, 7, 30)
+
+    time.sleep(1)
+    assert post('/rpc/details').json()['test/levels']['clients'] == 7
+
+    worker = requests.Session()
+    for _ in range(7):
+        task = worker.post(L + '/rpc/add', json={'name': 'test/levels', 'option': 'no_id'}, timeout=TIMEOUT).json()
+        worker.post(L + '/rpc/result', json={'result': task['request']})
+    time.sleep(0.5)
+    assert result == [0, 2, 4, 7, 1, 6, 3, 5]
+
+
+def test_weights():
+    # methods are created by their own workers, test/fair_a with weight 3
+    for name, limits in [('test/fair_a', {'weight': 3}), ('test/fair_b', {'weight': 1})]:
+        @run(0)
+        def worker(name=name, limits=limits):
+            worker = requests.Session()
+            worker.post(L + '/rpc/add', json={'name': name, 'option': 'no_id', 'limits': limits}, timeout=TIMEOUT)
+            worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+
+        time.sleep(0.1)
+        assert post('/' + name, json={}).status_code == 200
+
+    for i in range(12):
+        for name in ['test/fair_a', 'test/fair_b']:
+            @run(0)
+            def send(name=name):
+                post('/' + name, json={'name': name})
+            time.sleep(0.01)
+    time.sleep(0.2)
+
+    served = []
+    worker = requests.Session()
+    for _ in range(24):
+        r = worker.post(L + '/rpc/add', json={'name': 'test/fair_a,test/fair_b', 'option': 'no_id'}, timeout=TIMEOUT)
+        served.append(r.headers['name'])
+        worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+
+    first = served[:12]
+    assert first.count('test/fair_a') >= 8
+    assert first.count('test/fair_b') >= 2
+    assert served.count('test/fair_a') == 12
+
+
+def get_metrics(url=L):
+    metrics = {}
+    for line in requests.get(url + '/rpc/metrics', timeout=TIMEOUT).text.splitlines():
+        if line and not line.startswith('#'):
+            key, value = line.rsplit(' ', 1)
+            metrics[key] = float(value)
+    return metrics
+
+
+def test_metrics():
+    @run(0)
+    def worker():
+        worker = requests.Session()
+        worker.post(L + '/rpc/add', json={'name': 'test/metrics', 'option': 'no_id'}, timeout=TIMEOUT)
+        time.sleep(0.2)
+        worker.post(L + '/rpc/result', json={'result': 'ok'}, timeout=TIMEOUT)
+
+    time.sleep(0.1)
+    assert post('/test/metrics', json={}).status_code == 200
+    assert post('/test/metrics', json={}, headers={'Timeout': '100'}).status_code == 504
+
+    m = get_metrics()
+    label = '{method="test/metrics"}'
+    assert m['ijson_requests_total' + label] == 2
+    assert m['ijson_results_total' + label] == 1
+    assert m['ijson_errors_5xx_total' + label] == 1
+    assert m['ijson_shed_total' + label] == 1
+    assert m['ijson_queued_clients' + label] == 0
+    assert m['ijson_inflight' + label] == 0
+    assert m['ijson_queue_wait_seconds_count' + label] == 1
+    assert m['ijson_service_seconds_count' + label] == 1
+    assert 0.2 <= m['ijson_service_seconds_sum' + label] < 1
+    assert m['ijson_service_seconds_bucket{method="test/metrics",le="0.131072"}'] == 0
+    assert m['ijson_service_seconds_bucket{method="test/metrics",le="+Inf"}'] == 1
+    assert m['ijson_loop_events_total{loop="0"}'] > 0
+
+
+class Node:
+    # another ijson with its own options
+    def __init__(self, port, *args):
+        self.url = 'http://localhost:%d' % port
+        self.process = subprocess.Popen([IJSON, '--host', '127.0.0.1:%d' % port, '--log', '0'] + list(args))
+        for _ in range(50):
+            try:
+                socket.create_connection(('localhost', port)).close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        raise Exception('ijson is not started')
+
+    def post(self, path, *a, **kw):
+        if 'timeout' not in kw:
+            kw['timeout'] = TIMEOUT
+        return requests.post(self.url + path, *a, **kw)
+
+    def stop(self):
+        self.process.terminate()
+        self.process.wait()
+
+
+def test_cache():
+    node = Node(8011, '--cache', '16')
+    try:
+        worker = requests.Session()
+
+        @run(0.1)
+        def client():
+            r = node.post('/test/cache', json={'id': 1, 'params': {'x': 1}})
+            assert r.json() == {'result': 'one'}
+
+        task = worker.post(node.url + '/rpc/add', json={'name': 'test/cache', 'option': 'no_id', 'limits': {'cache': 5000}}, timeout=TIMEOUT).json()
+        assert task['params'] == {'x': 1}
+        worker.post(node.url + '/rpc/result', json={'result': 'one'}, timeout=TIMEOUT)
+        time.sleep(0.1)
+
+        # the same params with another id or without id
+        r = node.post('/test/cache', json={'id': 2, 'params': {'x': 1}})
+        assert r.status_code == 200
+        assert r.json() == {'result': 'one'}
+        assert r.headers['Id'] == '2'
+        r = node.post('/test/cache', json={'params': {'x': 1}})
+        assert r.status_code == 200
+        assert r.headers['Id']
+
+        # a miss waits for a worker
+        r = node.post('/test/cache', json={'id': 3, 'params': {'x': 2}}, headers={'Timeout': '100'})
+        assert r.status_code == 504
+
+        # Cache: 0 - the result is not cached
+        @run(0.1)
+        def client2():
+            node.post('/test/cache', json={'params': {'x': 3}})
+
+        worker.post(node.url + '/rpc/add', json={'name': 'test/cache', 'option': 'no_id'}, timeout=TIMEOUT)
+        worker.post(node.url + '/rpc/result', json={'result': 'three'}, headers={'Cache': '0'}, timeout=TIMEOUT)
+        time.sleep(0.1)
+        r = node.post('/test/cache', json={'params': {'x': 3}}, headers={'Timeout': '100'})
+        assert r.status_code == 504
+
+        m = get_metrics(node.url)
+        assert m['ijson_cache_hits_total{method="test/cache"}'] == 2
+        assert m['ijson_cache_misses_total{method="test/cache"}'] == 4
+    finally:
+        node.stop()
+
+
+def test_coalesce():
+    worker = requests.Session()
+
+    @run(0.1)
+    def first():
+        post('/test/coalesce', json={'params': 0})
+
+    worker.post(L + '/rpc/add', json={'name': 'test/coalesce', 'option': 'no_id', 'limits': {'coalesce': True}}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/result', json={'result': 0}, timeout=TIMEOUT)
+    time.sleep(0.1)
+
+    responses = {}
+
+    def request(delay, id, params):
+        @run(delay)
+        def send():
+            responses[id] = post('/test/coalesce', json={'id': id, 'params': params})
+
+    request(0, 1, 'same')
+    request(0.05, 2, 'same')
+    request(0.1, 3, 'same')
+    request(0.15, 4, 'other')
+    time.sleep(0.3)
+
+    tasks = []
+    for _ in range(2):
+        task = worker.post(L + '/rpc/add', json={'name': 'test/coalesce', 'option': 'no_id'}, timeout=TIMEOUT).json()
+        tasks.append(task['params'])
+        worker.post(L + '/rpc/result', json={'result': task['params'] + '!'}, timeout=TIMEOUT)
+    time.sleep(0.1)
+
+    assert tasks == ['same', 'other']
+    for id in [1, 2, 3]:
+        assert responses[id].status_code == 200
+        assert responses[id].json() == {'result': 'same!'}
+    # the waiting calls get their own ids
+    assert responses[2].headers['Id'] == '2'
+    assert responses[3].headers['Id'] == '3'
+    assert responses[4].json() == {'result': 'other!'}
+    assert get_metrics()['ijson_coalesced_total{method="test/coalesce"}'] == 2
+
+
+def test_wal_replay(tmp_path):
+    args = ['--wal', str(tmp_path), '--durable', 'test/job*']
+    node = Node(8012, *args)
+    try:
+        ids = []
+        for i in range(3):
+            r = node.post('/test/job', json={'value': i})
+            assert r.status_code == 202
+            ids.append(r.headers['Id'])
+    finally:
+        node.stop()
+
+    node = Node(8012, *args)
+    try:
+        # jobs are queued again on start, by the loops
+        time.sleep(0.3)
+        assert node.post('/rpc/details').json()['test/job']['clients'] == 3
+        worker = requests.Session()
+        for i in range(2):
+            task = worker.post(node.url + '/rpc/add', json={'name': 'test/job'}, timeout=TIMEOUT)
+            assert task.json() == {'value': i}
+            assert task.headers['Id'] == ids[i]
+            worker.post(node.url + '/rpc/result', json={'result': i}, headers={'Id': ids[i]}, timeout=TIMEOUT)
+        r = node.post('/rpc/fetch/' + ids[0])
+        assert r.status_code == 200
+        assert r.json() == {'result': 0}
+
+        # a worker is lost with the job
+        s = socket.create_connection(('localhost', 8012))
+        s.sendall(b'POST /rpc/add HTTP/1.1\r\nContent-Length: 20\r\n\r\n{"name": "test/job"}')
+        assert ids[2].encode() in s.recv(4096)
+        s.close()
+        time.sleep(0.2)
+        assert node.post('/rpc/details').json()['test/job']['clients'] == 1
+    finally:
+        node.stop()
+
+    node = Node(8012, *args)
+    try:
+        # only the job without a result is left
+        worker = requests.Session()
+        task = worker.post(node.url + '/rpc/add', json={'name': 'test/job'}, timeout=TIMEOUT)
+        assert task.headers['Id'] == ids[2]
+        assert node.post('/rpc/details').json()['test/job']['clients'] == 0
+    finally:
+        node.stop()
+
+
+def test_job_attempts():
+    def lost_worker():
+        # takes a task and disconnects
+        s = socket.create_connection(('localhost', 8001))
+        s.sendall(b'POST /rpc/add HTTP/1.1\r\nContent-Length: 25\r\n\r\n{"name": "test/attempts"}')
+        data = s.recv(4096)
+        s.close()
+        return data
+
+    tasks = []
+
+    @run(0)
+    def first():
+        tasks.append(lost_worker())
+
+    time.sleep(0.1)
+    r = post('/test/attempts', json={'value': 1}, headers={'Option': 'async'})
+    assert r.status_code == 202
+    id = r.headers['Id']
+    time.sleep(0.1)
+    for _ in range(4):
+        tasks.append(lost_worker())
+        time.sleep(0.1)
+    assert all(id.encode() in task for task in tasks)
+
+    # the job fails after 5 lost workers
+    r = post('/rpc/fetch/' + id)
+    assert r.status_code == 503
+
+
+def test_async():
+    worker = requests.Session()
+
+    @run(0.1)
+    def first():
+        post('/test/async', json={'value': 0})
+
+    task = worker.post(L + '/rpc/add', json={'name': 'test/async'}, timeout=TIMEOUT)
+    worker.post(L + '/rpc/result', json={'result': 0}, headers={'Id': task.headers['Id']}, timeout=TIMEOUT)
+
+    r = post('/test/async', json={'value': 1}, headers={'Option': 'async'})
+    assert r.status_code == 202
+    id = r.headers['Id']
+    assert post('/rpc/fetch/' + id).status_code == 202
+
+    task = worker.post(L + '/rpc/add', json={'name': 'test/async'}, timeout=TIMEOUT)
+    assert task.headers['Id'] == id
+    assert task.json() == {'value': 1}
+    worker.post(L + '/rpc/result', json={'result': 1}, headers={'Id': id}, timeout=TIMEOUT)
+    time.sleep(0.1)
+
+    r = post('/rpc/fetch/' + id)
+    assert r.status_code == 200
+    assert r.json() == {'result': 1}
+    assert post('/rpc/fetch/unknown-id').status_code == 404
+
+    # fetch waits for the result
+    r = post('/test/async', json={'value': 2}, headers={'Option': 'async'})
+    id = r.headers['Id']
+
+    @run(0.2)
+    def late_worker():
+        worker.post(L + '/rpc/add', json={'name': 'test/async'}, timeout=TIMEOUT)
+        worker.post(L + '/rpc/result', json={'result': 2}, headers={'Id': id}, timeout=TIMEOUT)
+
+    start = time.time()
+    r = post('/rpc/fetch/' + id, headers={'Timeout': '3000'})
+    assert r.status_code == 200
+    assert r.json() == {'result': 2}
+    assert 0.15 < time.time() - start < 2
+
+
+def test_broadcast():
+    tasks = []
+
+    def workers(count):
+        for i in range(count):
+            @run(0)
+            def worker(i=i):
+                worker = requests.Session()
+                task = worker.post(L + '/rpc/add', json={'name': 'test/broadcast', 'option': 'no_id'}, timeout=TIMEOUT).json()
+                tasks.append(task)
+                worker.post(L + '/rpc/result', json={'worker': i}, timeout=TIMEOUT)
+        time.sleep(0.1)
+
+    workers(3)
+    r = post('/test/broadcast', json={'reload': 1}, headers={'Broadcast': 'all'})
+    assert r.status_code == 200
+    assert r.headers['Delivered'] == '3'
+    assert sorted(it['worker'] for it in r.json()) == [0, 1, 2]
+    assert tasks == [{'reload': 1}] * 3
+
+    workers(3)
+    r = post('/test/broadcast', json={'reload': 2}, headers={'Broadcast': '2'})
+    assert r.status_code == 200
+    assert r.headers['Delivered'] == '3'
+    assert len(r.json()) == 2
+
+    time.sleep(0.1)
+    workers(2)
+    r = post('/test/broadcast', json={'reload': 3}, headers={'Broadcast': 'first'})
+    assert r.status_code == 200
+    assert r.json()['worker'] in [0, 1]
+
+    time.sleep(0.1)
+    r = post('/test/broadcast', json={'reload': 4}, headers={'Broadcast': 'all'})
+    assert r.status_code == 503
+
+
+def test_peers():
+    a = Node(8021, '--peer', '127.0.0.1:8022')
+    b = Node(8022, '--peer', '127.0.0.1:8021')
+    try:
+        worker = requests.Session()
+
+        @run(0)
+        def remote_worker():
+            task = worker.post(b.url + '/rpc/add', json={'name': 'test/remote', 'option': 'no_id'}, timeout=TIMEOUT)
+            worker.post(b.url + '/rpc/result', json={'result': task.json()['value'] * 2}, timeout=TIMEOUT)
+
+        # a node retries a peer in 1 sec, then they exchange idle workers every 100ms
+        time.sleep(1.3)
+        r = a.post('/test/remote', json={'value': 21})
+        assert r.status_code == 200
+        assert r.json() == {'result': 42}
+        assert get_metrics(a.url)['ijson_forwarded_total{method="test/remote"}'] == 1
+
+        # the worker doesn't answer in time
+        @run(0)
+        def slow_worker():
+            worker.post(b.url + '/rpc/add', json={'name': 'test/remote', 'option': 'no_id'}, timeout=TIMEOUT)
+            time.sleep(0.5)
+            worker.post(b.url + '/rpc/result', json={'result': 0}, timeout=TIMEOUT)
+
+        time.sleep(0.5)
+        start = time.time()
+        r = a.post('/test/remote', json={'value': 1}, headers={'Timeout': '200'})
+        assert r.status_code == 504
+        assert time.time() - start < 0.5
+        time.sleep(0.5)  # the late result
+    finally:
+        a.stop()
+        b.stop()
+
+    # other nodes can't know the name of 0.0.0.0
+    r = subprocess.run([IJSON, '--host', '0.0.0.0:8023', '--peer', '127.0.0.1:8021'], capture_output=True, timeout=TIMEOUT)
+    assert r.returncode == 1
+    assert b'--node-name' in r.stdout
+
+
+def test_handover(tmp_path):
+    path = str(tmp_path / 'handover.sock')
+    old = Node(8031, '--handover', path)
+    new = None
+    try:
+        result = None
+
+        @run(0)
+        def worker():
+            nonlocal result
+            worker = requests.Session()
+            task = worker.post(old.url + '/rpc/add', json={'name': 'test/handover', 'option': 'no_id'}, timeout=TIMEOUT).json()
+            worker.post(old.url + '/rpc/result', json={'result': task['value']}, timeout=TIMEOUT)
+            result = 'done'
+
+        time.sleep(0.1)
+        new = Node(8031, '--handover', path)
+        # the old process gives the port and the waiting worker away and exits
+        old.process.wait(timeout=3)
+
+        r = new.post('/test/handover', json={'value': 5})
+        assert r.status_code == 200
+        assert r.json() == {'result': 5}
+        time.sleep(0.1)
+        assert result == 'done'
+    finally:
+        old.stop()
+        if new:
+            new.stop()